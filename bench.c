@@ -0,0 +1,142 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/**
+ * Benchmark of the cursor conversion on the headless EGL backend, e.g.:
+ * LIBGL_ALWAYS_SOFTWARE=1 cursor-bench 1000 1.5
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xf86drmMode.h>
+
+#include "drm_common.h"
+#include "drm_egl.h"
+
+#define BENCH_ITERATIONS 1000
+
+static const int bench_sizes[] = { 24, 32, 48, 64, 128, 256 };
+
+static uint64_t bench_time_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int bench_size(void *ctx, int size, float scale, uint32_t rotation,
+                      int iterations, int report)
+{
+  int scaled = size * scale;
+  uint32_t *pixels, *out;
+  uint64_t *samples, start, total = 0;
+  int i, x, y, ret = -1;
+
+  if (scaled < 1) {
+    fprintf(stderr, "invalid scale %f of %dx%d\n", scale, size, size);
+    return -1;
+  }
+
+  pixels = malloc(size * size * 4);
+  out = malloc(scaled * scaled * 4);
+  samples = calloc(iterations, sizeof(*samples));
+  if (!pixels || !out || !samples)
+    goto out;
+
+  for (i = 0; i < size * size; i++)
+    pixels[i] = 0x4F000000 | ((i % size) * 2 & 0xFF) << 16 |
+      ((i / size) & 0xFF) << 8;
+
+  for (i = 0; i < iterations; i++) {
+    /* Every other one is an edge move, with the offset math */
+    x = i % 2 ? (i / 2) % scaled : 0;
+    y = i % 4 == 1 ? (i / 4) % scaled : 0;
+
+    start = bench_time_ns();
+    if (egl_convert_pixels(ctx, pixels, size, size, scaled, scaled,
+                           x, y, rotation, out) < 0) {
+      fprintf(stderr, "failed to convert %dx%d\n", size, size);
+      goto out;
+    }
+    samples[i] = bench_time_ns() - start;
+    total += samples[i];
+  }
+
+  ret = 0;
+  if (!report)
+    goto out;
+
+  qsort(samples, iterations, sizeof(*samples), bench_compare);
+
+  printf("%4dx%-4d -> %4dx%-4d %10.1f %8.1f %8.1f %8.1f %8.1f\n",
+         size, size, scaled, scaled, iterations * 1e9 / total,
+         samples[iterations / 2] / 1e3,
+         samples[iterations * 90 / 100] / 1e3,
+         samples[iterations * 99 / 100] / 1e3,
+         samples[iterations - 1] / 1e3);
+out:
+  free(samples);
+  free(out);
+  free(pixels);
+  return ret;
+}
+
+int main(int argc, const char **argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : BENCH_ITERATIONS;
+  float scale = argc > 2 ? atof(argv[2]) : 1.0;
+  uint32_t rotation = DRM_MODE_ROTATE_0;
+  void *ctx;
+  unsigned i;
+  int ret = 0;
+
+  if (argc > 3)
+    rotation = strtoul(argv[3], NULL, 0);
+
+  if (iterations < 1 || scale <= 0) {
+    fprintf(stderr, "usage: %s [iterations] [scale] [rotation]\n", argv[0]);
+    return -1;
+  }
+
+  ctx = egl_init_headless(NULL);
+  if (!ctx)
+    return -1;
+
+  /* Warm up the driver */
+  bench_size(ctx, 64, 1.0, DRM_MODE_ROTATE_0, 10, 0);
+
+  printf("%-21s %10s %8s %8s %8s %8s\n",
+         "size", "conv/s", "p50-us", "p90-us", "p99-us", "max-us");
+
+  for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+    ret = bench_size(ctx, bench_sizes[i], scale, rotation, iterations, 1);
+    if (ret < 0)
+      break;
+  }
+
+  egl_free_ctx(ctx);
+  return ret;
+}
@@ -0,0 +1,369 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "drm_common.h"
+#include "drm_client.h"
+#include "drm_protocol.h"
+
+/* Forwarding cursor requests to the cursor daemon */
+
+typedef struct {
+  pthread_mutex_t mutex;
+
+  char path[108];
+  int drm_fd;
+
+  int sock;
+  int ring_fd;
+  int event_fd;
+  drm_ring *ring;
+
+  /* CRTCs of the ring's latest slots */
+  uint32_t latest_crtcs[DRM_RING_MAX_CRTCS];
+  int num_latest;
+
+  uint64_t coalesced; /* Moves coalesced for the ring being full */
+} drm_client;
+
+static int drm_client_hello(drm_client *client)
+{
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  drm_msg msg = { .type = DRM_MSG_HELLO };
+  struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = u.buf,
+    .msg_controllen = sizeof(u.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  int fds[3] = { client->drm_fd, client->ring_fd, client->event_fd };
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  return sendmsg(client->sock, &mh, MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+}
+
+static void drm_client_disconnect(drm_client *client)
+{
+  if (client->sock >= 0)
+    close(client->sock);
+  client->sock = -1;
+}
+
+static int drm_client_reconnect(drm_client *client)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  drm_client_disconnect(client);
+
+  client->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (client->sock < 0)
+    return -1;
+
+  strcpy(addr.sun_path, client->path);
+  if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto err;
+
+  /* Moves posted to the dead daemon are gone */
+  memset(client->ring->latest, 0, sizeof(client->ring->latest));
+  client->num_latest = 0;
+  __atomic_store_n(&client->ring->coalesced, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&client->ring->head, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&client->ring->tail, 0, __ATOMIC_RELEASE);
+
+  if (drm_client_hello(client) < 0)
+    goto err;
+
+  DRM_INFO("connected to cursor daemon: %s\n", client->path);
+  return 0;
+err:
+  drm_client_disconnect(client);
+  return -1;
+}
+
+drm_private void *drm_client_connect(const char *path, int drm_fd)
+{
+  drm_client *client;
+
+  if (strlen(path) >= sizeof(client->path))
+    return NULL;
+
+  client = calloc(1, sizeof(*client));
+  if (!client)
+    return NULL;
+
+  pthread_mutex_init(&client->mutex, NULL);
+  strcpy(client->path, path);
+  client->drm_fd = drm_fd;
+  client->sock = -1;
+
+  client->ring_fd = memfd_create("drm-cursor-ring", MFD_CLOEXEC);
+  if (client->ring_fd < 0 || ftruncate(client->ring_fd, sizeof(drm_ring)) < 0)
+    goto err;
+
+  client->ring = mmap(NULL, sizeof(drm_ring), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, client->ring_fd, 0);
+  if (client->ring == MAP_FAILED)
+    goto err;
+
+  client->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (client->event_fd < 0)
+    goto err_unmap;
+
+  if (drm_client_reconnect(client) < 0) {
+    DRM_ERROR("failed to connect cursor daemon: %s\n", path);
+    goto err_close_event;
+  }
+
+  return client;
+err_close_event:
+  close(client->event_fd);
+err_unmap:
+  munmap(client->ring, sizeof(drm_ring));
+err:
+  if (client->ring_fd >= 0)
+    close(client->ring_fd);
+  free(client);
+  return NULL;
+}
+
+drm_private int drm_client_connected(void *data)
+{
+  drm_client *client = data;
+  int ret;
+
+  pthread_mutex_lock(&client->mutex);
+  ret = client->sock >= 0;
+  pthread_mutex_unlock(&client->mutex);
+
+  return ret;
+}
+
+/**
+ * Stop forwarding, the caller falls back to the in-process cursors.
+ * The client is kept, since other threads might still be calling it.
+ */
+drm_private void drm_client_close(void *data)
+{
+  drm_client *client = data;
+
+  pthread_mutex_lock(&client->mutex);
+  drm_client_disconnect(client);
+  pthread_mutex_unlock(&client->mutex);
+}
+
+/* The fd number got re-pointed to another file */
+drm_private int drm_client_set_fd(void *data, int drm_fd)
+{
+  drm_client *client = data;
+  int ret;
+
+  pthread_mutex_lock(&client->mutex);
+  client->drm_fd = drm_fd;
+  ret = drm_client_reconnect(client);
+  pthread_mutex_unlock(&client->mutex);
+
+  return ret;
+}
+
+/* Send the request and wait for the reply, with the mutex held */
+static int drm_client_request(drm_client *client, const drm_msg *msg,
+                              drm_msg_reply *reply)
+{
+  int retry;
+
+  for (retry = 0; retry < 2; retry++) {
+    if (client->sock < 0 && drm_client_reconnect(client) < 0)
+      return -1;
+
+    if (send(client->sock, msg, sizeof(*msg), MSG_NOSIGNAL) == sizeof(*msg) &&
+        recv(client->sock, reply, sizeof(*reply), 0) == sizeof(*reply))
+      return reply->ret;
+
+    /* The daemon might have restarted */
+    DRM_ERROR("lost cursor daemon (%d)\n", errno);
+    drm_client_disconnect(client);
+  }
+
+  return -1;
+}
+
+drm_private int drm_client_set(void *data, uint32_t crtc_id,
+                               const uint32_t *handles, int count,
+                               uint32_t width, uint32_t height,
+                               int hot_x, int hot_y, uint32_t interval)
+{
+  drm_client *client = data;
+  drm_msg msg = {
+    .type = DRM_MSG_SET,
+    .crtc_id = crtc_id,
+    .width = width,
+    .height = height,
+    .hot_x = hot_x,
+    .hot_y = hot_y,
+    .interval = interval,
+    .count = count,
+  };
+  drm_msg_reply reply;
+  int ret;
+
+  if (count <= 0 || count > DRM_MSG_MAX_FRAMES)
+    return -1;
+
+  memcpy(msg.handles, handles, count * sizeof(*handles));
+
+  pthread_mutex_lock(&client->mutex);
+  ret = drm_client_request(client, &msg, &reply);
+  pthread_mutex_unlock(&client->mutex);
+
+  return ret;
+}
+
+/* Keep the latest position of each CRTC, following the entries before pos */
+static void drm_client_coalesce(drm_client *client,
+                                const drm_cursor_pos *positions, int count,
+                                uint64_t timestamp, uint32_t pos)
+{
+  drm_ring *ring = client->ring;
+  drm_ring_latest *latest;
+  uint32_t seq;
+  int i, j;
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < client->num_latest; j++) {
+      if (client->latest_crtcs[j] == positions[i].crtc_id)
+        break;
+    }
+
+    if (j == client->num_latest) {
+      if (j == DRM_RING_MAX_CRTCS) {
+        DRM_ERROR("too many CRTCs to coalesce: %d\n", positions[i].crtc_id);
+        continue;
+      }
+
+      client->latest_crtcs[client->num_latest++] = positions[i].crtc_id;
+    }
+
+    latest = &ring->latest[j];
+    seq = latest->seq;
+
+    __atomic_store_n(&latest->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&latest->pos, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&latest->crtc_id, positions[i].crtc_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&latest->x, positions[i].x, __ATOMIC_RELAXED);
+    __atomic_store_n(&latest->y, positions[i].y, __ATOMIC_RELAXED);
+    __atomic_store_n(&latest->timestamp, timestamp, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&latest->seq, seq + 2, __ATOMIC_RELEASE);
+  }
+
+  __atomic_add_fetch(&ring->coalesced, 1, __ATOMIC_SEQ_CST);
+}
+
+drm_private int drm_client_move(void *data, const drm_cursor_pos *positions,
+                                int count, uint64_t timestamp)
+{
+  drm_client *client = data;
+  drm_ring *ring = client->ring;
+  uint64_t value = 1;
+  uint32_t head, tail;
+  int i;
+
+  if (count <= 0 || count > DRM_RING_SIZE)
+    return -1;
+
+  pthread_mutex_lock(&client->mutex);
+
+  /* The daemon might have restarted */
+  if (client->sock < 0 && drm_client_reconnect(client) < 0) {
+    pthread_mutex_unlock(&client->mutex);
+    return -1;
+  }
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  tail = ring->tail;
+
+  /* The daemon is stalled, so that only the final positions matter */
+  if (tail - head + count > DRM_RING_SIZE) {
+    if (!(client->coalesced++ % 1000))
+      DRM_ERROR("cursor daemon ring full, coalesced: %"PRIu64"\n",
+                client->coalesced);
+
+    drm_client_coalesce(client, positions, count, timestamp, tail);
+    goto wake;
+  }
+
+  for (i = 0; i < count; i++) {
+    drm_ring_entry *entry = &ring->entries[(tail + i) % DRM_RING_SIZE];
+
+    entry->crtc_id = positions[i].crtc_id;
+    entry->x = positions[i].x;
+    entry->y = positions[i].y;
+    entry->count = i ? 0 : count;
+    entry->timestamp = timestamp;
+  }
+
+  /* Publish the whole batch at once */
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_SEQ_CST);
+wake:
+  /**
+   * The daemon drains until empty, only wake it when it was (or has drained
+   * the full ring meanwhile).
+   * Paired with the daemon's storing head and then checking tail/coalesced.
+   */
+  head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+  if (head == tail && write(client->event_fd, &value, sizeof(value)) < 0)
+    DRM_DEBUG("failed to signal cursor daemon (%d)\n", errno);
+
+  pthread_mutex_unlock(&client->mutex);
+  return 0;
+}
+
+drm_private int drm_client_query(void *data, uint32_t crtc_id,
+                                 drm_cursor_info *info)
+{
+  drm_client *client = data;
+  drm_msg msg = { .type = DRM_MSG_QUERY, .crtc_id = crtc_id };
+  drm_msg_reply reply;
+  int ret;
+
+  pthread_mutex_lock(&client->mutex);
+  ret = drm_client_request(client, &msg, &reply);
+  pthread_mutex_unlock(&client->mutex);
+
+  if (!ret)
+    *info = reply.info;
+
+  return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_CLIENT_H_
+#define __DRM_CLIENT_H_
+
+#include <stdint.h>
+
+#include "drm_common.h"
+#include "drm_cursor.h"
+
+drm_private void *drm_client_connect(const char *path, int drm_fd);
+drm_private int drm_client_connected(void *data);
+drm_private void drm_client_close(void *data);
+drm_private int drm_client_set_fd(void *data, int drm_fd);
+drm_private int drm_client_set(void *data, uint32_t crtc_id, const uint32_t *handles, int count, uint32_t width, uint32_t height, int hot_x, int hot_y, uint32_t interval);
+drm_private int drm_client_move(void *data, const drm_cursor_pos *positions, int count, uint64_t timestamp);
+drm_private int drm_client_query(void *data, uint32_t crtc_id, drm_cursor_info *info);
+
+#endif
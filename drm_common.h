@@ -17,6 +17,7 @@
 
 #include <drm_fourcc.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/time.h>
@@ -33,17 +34,36 @@
 #define DRM_FORMAT_MOD_ARM_AFBC(__afbc_mode) fourcc_mod_code(ARM, __afbc_mode)
 #endif
 
-#ifndef AFBC_FORMAT_MOD_BLOCK_SIZE_16x16
-#define AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 (1ULL)
+#ifndef AFBC_FORMAT_MOD_YTR
+#define AFBC_FORMAT_MOD_YTR (((__u64)1) << 4)
+#endif
+
+#ifndef AFBC_FORMAT_MOD_SPLIT
+#define AFBC_FORMAT_MOD_SPLIT (((__u64)1) << 5)
 #endif
 
 #ifndef AFBC_FORMAT_MOD_SPARSE
 #define AFBC_FORMAT_MOD_SPARSE (((__u64)1) << 6)
 #endif
 
-#define DRM_AFBC_MODIFIER \
-  (DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_SPARSE) | \
-   DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16))
+/* ARM modifiers of type 0 (bits 52-55) are AFBC */
+#define DRM_MOD_IS_AFBC(mod) \
+  (((mod) >> 56) == DRM_FORMAT_MOD_VENDOR_ARM && !(((mod) >> 52) & 0xf))
+
+/* FNV-1a */
+#define DRM_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t drm_hash(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *ptr = data;
+
+  while (size--) {
+    hash ^= *ptr++;
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
 
 #define DRM_LOG(tag, ...) { \
   struct timeval tv; gettimeofday(&tv, NULL); \
@@ -0,0 +1,380 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "drm_common.h"
+#include "drm_control.h"
+
+/**
+ * Control socket for other clients (e.g. video players) to borrow the
+ * cursor planes, with a line protocol:
+ *   "yield <plane id>"   -> "ok" once the cursor has left the plane
+ *   "reclaim <plane id>" -> "ok" once the plane is returned
+ * Planes yielded by a client are returned when it disconnects.
+ * A pending yield holds back the client's later commands, but not the
+ * other clients.
+ */
+
+#define MAX_CLIENTS 8
+#define MAX_YIELDS 8
+
+/* Max wait for the cursor to leave a yielded plane */
+#define YIELD_TIMEOUT_MS 1000
+
+typedef struct {
+  int fd;
+  char buf[128];
+  int len;
+
+  uint32_t planes[MAX_YIELDS];
+  int num_planes;
+
+  /* Yield waiting for the cursor to leave, 0 for none */
+  uint32_t pending_plane;
+  uint64_t pending_deadline;
+} drm_control_client;
+
+static drm_control_yield_fn g_yield_fn;
+static drm_control_busy_fn g_busy_fn;
+static drm_control_client g_clients[MAX_CLIENTS];
+static int g_listen_fd = -1;
+static int g_wake_fd = -1;
+
+static uint64_t drm_control_time_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void drm_control_reply(drm_control_client *client, int ret)
+{
+  const char *reply = ret ? "fail\n" : "ok\n";
+
+  if (send(client->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+    DRM_DEBUG("control: failed to reply (%d)\n", errno);
+}
+
+/* Returns 1 while the cursor is still leaving the plane */
+static int drm_control_yield(drm_control_client *client, uint32_t plane_id)
+{
+  int i, ret;
+
+  for (i = 0; i < client->num_planes; i++) {
+    if (client->planes[i] == plane_id)
+      break;
+  }
+
+  if (i == MAX_YIELDS)
+    return -1;
+
+  ret = g_yield_fn(plane_id, 1);
+  if (ret < 0)
+    return -1;
+
+  /* Recorded even when timing out later, to be returned on closing */
+  if (i == client->num_planes)
+    client->planes[client->num_planes++] = plane_id;
+
+  if (!ret)
+    return 0;
+
+  client->pending_plane = plane_id;
+  client->pending_deadline = drm_control_time_ms() + YIELD_TIMEOUT_MS;
+  return 1;
+}
+
+/* Reply the pending yield once done or timed out */
+static int drm_control_check_pending(drm_control_client *client)
+{
+  if (!client->pending_plane)
+    return 0;
+
+  if (g_busy_fn(client->pending_plane)) {
+    if (drm_control_time_ms() < client->pending_deadline)
+      return 1;
+
+    DRM_ERROR("control: timeout yielding plane: %d\n",
+              client->pending_plane);
+    drm_control_reply(client, -1);
+  } else {
+    drm_control_reply(client, 0);
+  }
+
+  client->pending_plane = 0;
+  return 0;
+}
+
+static int drm_control_reclaim(drm_control_client *client, uint32_t plane_id)
+{
+  int i;
+
+  for (i = 0; i < client->num_planes; i++) {
+    if (client->planes[i] != plane_id)
+      continue;
+
+    client->planes[i] = client->planes[--client->num_planes];
+    return g_yield_fn(plane_id, 0);
+  }
+
+  /* Not yielded to this client */
+  return -1;
+}
+
+static void drm_control_close(drm_control_client *client)
+{
+  DRM_INFO("control: client %d closed\n", client->fd);
+
+  while (client->num_planes)
+    drm_control_reclaim(client, client->planes[0]);
+
+  close(client->fd);
+  client->fd = -1;
+}
+
+static void drm_control_handle(drm_control_client *client, char *line)
+{
+  uint32_t plane_id;
+  int ret = -1;
+
+  DRM_DEBUG("control: client %d: %s\n", client->fd, line);
+
+  if (sscanf(line, "yield %u", &plane_id) == 1 && plane_id)
+    ret = drm_control_yield(client, plane_id);
+  else if (sscanf(line, "reclaim %u", &plane_id) == 1)
+    ret = drm_control_reclaim(client, plane_id);
+  else
+    DRM_ERROR("control: unknown command: %s\n", line);
+
+  /* Replied later */
+  if (ret > 0)
+    return;
+
+  drm_control_reply(client, ret);
+}
+
+/* Handle the buffered lines, until one is pending */
+static void drm_control_process(drm_control_client *client)
+{
+  char *line, *end;
+
+  for (line = client->buf; !client->pending_plane &&
+       (end = strchr(line, '\n')); line = end + 1) {
+    *end = '\0';
+    drm_control_handle(client, line);
+  }
+
+  client->len -= line - client->buf;
+  memmove(client->buf, line, client->len + 1);
+}
+
+static void drm_control_read(drm_control_client *client)
+{
+  ssize_t len;
+
+  len = recv(client->fd, client->buf + client->len,
+             sizeof(client->buf) - client->len - 1, 0);
+  if (len <= 0) {
+    if (len < 0 && errno == EINTR)
+      return;
+
+    drm_control_close(client);
+    return;
+  }
+
+  client->len += len;
+  client->buf[client->len] = '\0';
+
+  drm_control_process(client);
+
+  /* Too long line */
+  if (client->len == sizeof(client->buf) - 1)
+    drm_control_close(client);
+}
+
+static void drm_control_accept(void)
+{
+  int fd, i;
+
+  fd = accept4(g_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (g_clients[i].fd >= 0)
+      continue;
+
+    memset(&g_clients[i], 0, sizeof(g_clients[i]));
+    g_clients[i].fd = fd;
+    DRM_INFO("control: client %d connected\n", fd);
+    return;
+  }
+
+  DRM_ERROR("control: too many clients\n");
+  close(fd);
+}
+
+static void *drm_control_thread_fn(void *data)
+{
+  struct pollfd fds[MAX_CLIENTS + 2];
+  drm_control_client *client;
+  uint64_t value, now;
+  int i, wait, timeout;
+
+  pthread_setname_np(pthread_self(), "drm-cursor-ctl");
+
+  while (1) {
+    fds[0].fd = g_listen_fd;
+    fds[0].events = POLLIN;
+
+    fds[1].fd = g_wake_fd;
+    fds[1].events = POLLIN;
+
+    timeout = -1;
+    now = drm_control_time_ms();
+    for (i = 0; i < MAX_CLIENTS; i++) {
+      client = &g_clients[i];
+
+      /* Only the hangups while pending */
+      fds[i + 2].fd = client->fd;
+      fds[i + 2].events = client->pending_plane ? 0 : POLLIN;
+
+      if (client->fd < 0 || !client->pending_plane)
+        continue;
+
+      wait = client->pending_deadline > now ?
+        client->pending_deadline - now : 0;
+      if (timeout < 0 || wait < timeout)
+        timeout = wait;
+    }
+
+    if (poll(fds, MAX_CLIENTS + 2, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      DRM_ERROR("control: failed to poll (%d)\n", errno);
+      break;
+    }
+
+    if (fds[1].revents && read(g_wake_fd, &value, sizeof(value)) < 0)
+      DRM_DEBUG("control: failed to read wake fd (%d)\n", errno);
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+      client = &g_clients[i];
+      if (client->fd < 0)
+        continue;
+
+      if (fds[i + 2].revents) {
+        drm_control_read(client);
+        if (client->fd < 0)
+          continue;
+      }
+
+      /* Carry on with the held back commands once replied */
+      if (client->pending_plane && !drm_control_check_pending(client))
+        drm_control_process(client);
+    }
+
+    if (fds[0].revents & POLLIN)
+      drm_control_accept();
+  }
+
+  return NULL;
+}
+
+/* Recheck the pending yields, e.g. after a cursor left its plane */
+drm_private void drm_control_notify(void)
+{
+  uint64_t value = 1;
+
+  if (g_wake_fd >= 0 && write(g_wake_fd, &value, sizeof(value)) < 0)
+    DRM_DEBUG("control: failed to wake (%d)\n", errno);
+}
+
+drm_private int drm_control_start(const char *path, mode_t mode, gid_t gid,
+                                  drm_control_yield_fn yield_fn,
+                                  drm_control_busy_fn busy_fn)
+{
+  struct sockaddr_un addr;
+  pthread_t thread;
+  int i;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    DRM_ERROR("control: socket path too long: %s\n", path);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  g_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (g_listen_fd < 0)
+    return -1;
+
+  /* Remove the stale one */
+  unlink(path);
+
+  if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    DRM_ERROR("control: failed to bind %s (%d)\n", path, errno);
+    goto err;
+  }
+
+  /* Restrict the clients, before listening */
+  if ((mode && chmod(path, mode) < 0) ||
+      (gid != (gid_t)-1 && chown(path, -1, gid) < 0) ||
+      listen(g_listen_fd, MAX_CLIENTS) < 0) {
+    DRM_ERROR("control: failed to listen on %s (%d)\n", path, errno);
+    unlink(path);
+    goto err;
+  }
+
+  for (i = 0; i < MAX_CLIENTS; i++)
+    g_clients[i].fd = -1;
+
+  g_yield_fn = yield_fn;
+  g_busy_fn = busy_fn;
+
+  g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (g_wake_fd < 0)
+    goto err;
+
+  if (pthread_create(&thread, NULL, drm_control_thread_fn, NULL))
+    goto err;
+
+  pthread_detach(thread);
+
+  DRM_INFO("control: listening on %s\n", path);
+  return 0;
+err:
+  if (g_wake_fd >= 0)
+    close(g_wake_fd);
+  g_wake_fd = -1;
+
+  close(g_listen_fd);
+  g_listen_fd = -1;
+  return -1;
+}
@@ -0,0 +1,40 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_CONTROL_H_
+#define __DRM_CONTROL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "drm_common.h"
+
+/**
+ * Yield (or take back) a plane, returns 0 on success, or 1 when the cursor
+ * is still leaving the yielded plane.
+ */
+typedef int (*drm_control_yield_fn)(uint32_t plane_id, int yield);
+
+/* Whether a cursor is still on the plane */
+typedef int (*drm_control_busy_fn)(uint32_t plane_id);
+
+/* Mode 0 keeps the umask, gid -1 keeps the group */
+drm_private int drm_control_start(const char *path, mode_t mode, gid_t gid,
+                                  drm_control_yield_fn yield_fn,
+                                  drm_control_busy_fn busy_fn);
+
+/* A cursor left its plane */
+drm_private void drm_control_notify(void);
+
+#endif
@@ -14,38 +14,98 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <link.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/sysmacros.h>
+
+#include <linux/dma-buf.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include <gbm.h>
 
+#include "drm_client.h"
 #include "drm_common.h"
+#include "drm_control.h"
+#include "drm_cursor.h"
 #include "drm_egl.h"
+#include "drm_input.h"
+#include "drm_protocol.h"
 
 #define DRM_CURSOR_CONFIG_FILE "/etc/drm-cursor.conf"
+#define DRM_CURSOR_CACHE_DIR "/var/cache/drm-cursor"
 #define OPT_DEBUG "debug="
 #define OPT_LOG_FILE "log-file="
 #define OPT_HIDE "hide="
 #define OPT_ALLOW_OVERLAY "allow-overlay="
-#define OPT_PREFER_AFBC "prefer-afbc="
 #define OPT_PREFER_PLANE "prefer-plane="
 #define OPT_PREFER_PLANES "prefer-planes="
 #define OPT_CRTC_BLOCKLIST "crtc-blocklist="
 #define OPT_NUM_SURFACES "num-surfaces="
+#define OPT_MAX_SURFACES "max-surfaces="
+#define OPT_POOL_BUDGET "pool-budget="
 #define OPT_MAX_FPS "max-fps="
 #define OPT_ATOMIC "atomic="
 #define OPT_SCALE "scale="
 #define OPT_SCALE_FROM "scale-from="
+#define OPT_IDLE_TIMEOUT "idle-timeout="
+#define OPT_STATS_FILE "stats-file="
+#define OPT_LATE_LATCH "late-latch="
+#define OPT_LATCH_MARGIN "latch-margin="
+#define OPT_FRAME_CACHE "frame-cache="
+#define OPT_ROTATION "rotation="
+#define OPT_REDUCED_DEPTH "reduced-depth="
+#define OPT_CONTROL_SOCKET "control-socket="
+#define OPT_CONTROL_SOCKET_MODE "control-socket-mode="
+#define OPT_CONTROL_SOCKET_GROUP "control-socket-group="
+#define OPT_SCHED_POLICY "sched-policy="
+#define OPT_SCHED_PRIORITY "sched-priority="
+#define OPT_CPU_AFFINITY "cpu-affinity="
+#define OPT_TIMER_SLACK "timer-slack="
+#define OPT_MLOCK "mlock="
+#define OPT_DAEMON_SOCKET "daemon-socket="
+#define OPT_EVDEV "evdev="
+#define OPT_EVDEV_SPEED "evdev-speed="
+#define OPT_EVDEV_ACCEL "evdev-accel="
+#define OPT_CACHE_DIR "cache-dir="
+#define OPT_MAX_POINTERS "max-pointers="
+#define OPT_CONVERT_BUDGET "convert-budget="
+
+/* Minimal interval of dumping stats (ms) */
+#define DRM_STATS_INTERVAL 1000
+
+/* Size of the per-fd context cache, larger fds use the slow path */
+#define DRM_MAX_FDS 1024
+
+/* The server's positions are applied after the input settled for this */
+#define DRM_INPUT_SETTLE_MS 100
+
+#ifndef KCMP_FILE
+#define KCMP_FILE 0
+#endif
 
-#define DRM_MAX_CRTCS 8
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define CLAMP(v, lo, hi) ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
 
 typedef enum {
   PLANE_PROP_type = 0,
@@ -63,6 +123,8 @@ typedef enum {
   PLANE_PROP_CRTC_Y,
   PLANE_PROP_CRTC_W,
   PLANE_PROP_CRTC_H,
+  PLANE_PROP_rotation,
+  PLANE_PROP_SCALING_FILTER,
   PLANE_PROP_MAX,
 } drm_plane_prop;
 
@@ -82,24 +144,102 @@ static const char *drm_plane_prop_names[] = {
   [PLANE_PROP_CRTC_Y] = "CRTC_Y",
   [PLANE_PROP_CRTC_W] = "CRTC_W",
   [PLANE_PROP_CRTC_H] = "CRTC_H",
+  [PLANE_PROP_rotation] = "rotation",
+  [PLANE_PROP_SCALING_FILTER] = "SCALING_FILTER",
 };
 
+/* Cursor format candidate of a plane */
+typedef struct {
+  uint32_t format;
+  uint64_t modifier;
+  int score;
+} drm_plane_format;
+
+/* Verdict of TEST_ONLY commits of a plane config */
+typedef struct {
+  uint32_t crtc_id; /* 0 for unused */
+  uint32_t format;
+  uint64_t modifier;
+  uint32_t rotation;
+  int w, h;
+  int src_w, src_h;
+  int clip; /* DRM_CLIP_* */
+  int ok;
+} drm_plane_verdict;
+
+/* Max cached verdicts of each plane */
+#define DRM_MAX_VERDICTS 32
+
+/* Clipping classes of the plane rect */
+#define DRM_CLIP_LEFT   (1 << 0)
+#define DRM_CLIP_TOP    (1 << 1)
+#define DRM_CLIP_RIGHT  (1 << 2)
+#define DRM_CLIP_BOTTOM (1 << 3)
+
+/* Backoff (ms) of re-probing failed atomic commits and legacy moves */
+#define DRM_ATOMIC_BACKOFF_MIN 100
+#define DRM_ATOMIC_BACKOFF_MAX 10000
+
+/* Stack size of the CRTC threads with mlock=1, GL drivers need quite some */
+#define DRM_THREAD_STACK_SIZE (1024 * 1024)
+
+/* Period (us) of halving the conversion average while degraded */
+#define DRM_BUDGET_DECAY_US 500000
+
+/* Backoff (ms) of re-initing the device after losing the daemon */
+#define DRM_INIT_BACKOFF_MIN 1000
+#define DRM_INIT_BACKOFF_MAX 60000
+
+/* Probed capabilities for selecting planes, persisted in the cache */
+typedef struct {
+  uint32_t possible_crtcs;
+  int32_t type;
+  int32_t zpos_max; /* -1 for none */
+  int32_t async_commit;
+  int32_t scaling_filter;
+  uint32_t rotations; /* Supported DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_* */
+} drm_plane_caps;
+
 typedef struct {
   uint32_t plane_id;
+  uint32_t crtc_id; /* Bound CRTC */
+  int type;
   int cursor_plane;
-  int can_afbc;
-  int can_linear;
-  drmModePlane *plane;
+  int yielded; /* Lent to another client */
+
+  drm_plane_caps caps;
+
+  /* Sorted by score, the best first */
+  drm_plane_format *formats;
+  int num_formats;
+
+  /* Loaded lazily when binding */
   drmModeObjectProperties *props;
   int prop_ids[PLANE_PROP_MAX];
+
+  /* Used by the bound CRTC's thread only */
+  drm_plane_verdict verdicts[DRM_MAX_VERDICTS];
+  int next_verdict;
 } drm_plane;
 
 #define REQ_SET_CURSOR  (1 << 0)
 #define REQ_MOVE_CURSOR (1 << 1)
+#define REQ_RESELECT    (1 << 2)
+
+/* Max cached frames of each CRTC, including animation frames */
+#define DRM_MAX_FRAMES 64
+
+/* Max wait for another CRTC converting the same frame */
+#define DRM_SHARE_TIMEOUT_MS 100
 
 typedef struct {
   uint32_t handle;
   uint32_t fb;
+  int cached; /* The fb is owned by the frame cache */
+
+  /* Of the fb */
+  uint32_t format;
+  uint64_t modifier;
 
   int width;
   int height;
@@ -119,21 +259,109 @@ typedef struct {
   int hot_x;
   int hot_y;
 
+  uint64_t timestamp; /* Input time of the position */
+
+  /* Animation played in the library */
+  uint32_t anim_handles[DRM_MAX_FRAMES];
+  int anim_count;
+  int anim_interval;
+
   int request;
 } drm_cursor_state;
 
+/* Converted cursor frame, keyed by content */
+typedef struct {
+  uint64_t hash;
+  int width;
+  int height;
+  int fb_w;
+  int fb_h;
+  uint32_t rotation; /* Rendered by GL */
+  uint32_t format;
+  uint64_t modifier;
+
+  void *buffer;
+  uint32_t fb;
+  uint64_t size;
+
+  uint64_t last_used;
+  int pinned; /* Used by the playing animation */
+  int pending; /* Being converted by its CRTC, without buffer yet */
+} drm_cursor_frame;
+
+/* Content info of a cursor image */
+typedef struct {
+  uint64_t hash;
+
+  /* Max channel errors (in 8-bit levels) of reduced-depth formats */
+  int err_1555;
+  int err_4444;
+} drm_cursor_content;
+
 typedef enum {
   IDLE = 0,
   FATAL_ERROR,
   PENDING,
 } drm_thread_state;
 
+/* Where to do the rotation or scaling */
+typedef enum {
+  TRANSFORM_UNKNOWN = 0,
+  TRANSFORM_PLANE,
+  TRANSFORM_GL,
+} drm_transform_mode;
+
+typedef struct {
+  uint64_t mem_bytes; /* Held by conversion buffers */
+  uint64_t trims;
+  uint64_t restores;
+  uint64_t last_restore_us;
+  uint64_t max_restore_us;
+  uint64_t latched; /* Moves replaced by a newer one at the deadline */
+  uint64_t deadline_hits;
+  uint64_t deadline_misses;
+  uint64_t last_latency_us; /* From input to presentation */
+  uint64_t max_latency_us;
+  uint64_t frame_hits;
+  uint64_t frame_misses;
+  uint64_t anim_frames;
+  uint64_t reduced_frames;
+  uint64_t shared_frames; /* Converted by other CRTCs */
+  uint64_t atomic_tests; /* TEST_ONLY commits of new plane configs */
+  uint64_t atomic_fallbacks; /* Commits done by the legacy API */
+  uint64_t avg_convert_us;
+  uint64_t max_convert_us;
+  uint64_t degrades; /* Conversions over the budget, entering degraded mode */
+  uint64_t degraded_moves; /* Edge moves clamped or stepped when degraded */
+  uint64_t last_wake_us; /* From wakeup to running */
+  uint64_t avg_wake_us;
+  uint64_t max_wake_us;
+  int plane_score; /* Of the selected plane */
+} drm_crtc_stats;
+
+/* Late-latching scheduler */
+typedef struct {
+  uint64_t latch_us; /* Estimated commit-to-latch time */
+  uint64_t margin_us; /* Adaptive safety margin */
+  uint32_t target_seq; /* The vblank of the last scheduled commit */
+  uint64_t target_time;
+  int has_target;
+} drm_crtc_sched;
+
+struct drm_ctx;
+
 typedef struct {
+  struct drm_ctx *ctx;
+
   uint32_t crtc_id;
   uint32_t crtc_pipe;
 
+  /* Index of the CRTC's pointers, 0 for the one of the libdrm APIs */
+  int pointer;
+
   int width;
   int height;
+  uint64_t frame_us;
 
   drm_plane *plane;
   uint32_t prefer_plane_id;
@@ -141,6 +369,15 @@ typedef struct {
   drm_cursor_state cursor_next;
   drm_cursor_state cursor_curr;
 
+  /* What's on screen, protected by the mutex */
+  drm_cursor_info presented;
+
+  drm_cursor_frame *frames;
+  uint64_t frames_size;
+
+  int anim_frame;
+  uint64_t anim_next_time;
+
   pthread_t thread;
   pthread_cond_t cond;
   pthread_mutex_t mutex;
@@ -150,37 +387,156 @@ typedef struct {
 
   int verified;
 
-  int use_afbc_modifier;
+  /* Disconnected since bound, the plane should be re-selected */
+  int unplugged;
+
+  /* The plane got yielded, or a better one available */
+  int reselect;
+
+  int format_idx; /* Of the plane's formats */
+
+  /* Reduced-depth formats validated or rejected by the plane */
+  uint32_t reduced_checked;
+  uint32_t reduced_rejected;
+
   int blocked;
   int async_commit;
 
+  /* DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_*, of the primary plane */
+  uint32_t rotation;
+
+  /* Moving by the legacy cursor ioctl, -1 when unusable */
+  int legacy_move;
+
+  /* Failed legacy moves, using SetPlane until re-probing (us) */
+  int legacy_fails;
+  uint64_t legacy_retry_time;
+
+  /* The size of the FB on screen, which the legacy move resizes the plane to */
+  uint32_t legacy_fb;
+  int legacy_fb_w, legacy_fb_h;
+
+  /* Failed atomic commits, using legacy ones until re-probing (us) */
+  int atomic_fails;
+  uint64_t atomic_retry_time;
+
+  /* The last commit was a legacy SetPlane, which might wait for vblank */
+  int commit_blocking;
+
+  drm_transform_mode rotation_mode;
+  drm_transform_mode scaling_mode;
+
+  /* The ctx's fd generation that the atomic cap was set for */
+  int fd_gen;
+
+  /* Resources released for idle, to be restored lazily */
+  int trimmed;
+
+  /* Conversions over the budget, edge moving by coarser steps */
+  int degraded;
+
+  /* Average conversion time (us) for the budget, decaying over time */
+  uint64_t budget_avg_us;
+  uint64_t budget_time;
+
+  drm_crtc_stats stats;
+  drm_crtc_sched sched;
+
   uint64_t last_update_time;
+
+  /* For the wakeup latency, protected by the mutex */
+  int waiting;
+  uint64_t post_time;
+
+  /* Direct input, protected by the mutex */
+  uint64_t input_time;
+  int server_x;
+  int server_y;
+  int has_server_pos;
 } drm_crtc;
 
-typedef struct {
+typedef struct drm_ctx {
+  struct drm_ctx *next;
+
+  /* Device identity, the registry key */
+  dev_t rdev;
+
   int fd;
+  int fd_gen;
+
+  /* Serializes binding planes and starting CRTC threads */
+  pthread_mutex_t mutex;
+
+  /* Protects the CRTCs' frame caches, for sharing frames between them */
+  pthread_mutex_t frames_mutex;
+
+  /* Signaled when a pending frame got converted (or dropped) */
+  pthread_cond_t frames_cond;
 
-  drm_crtc crtcs[DRM_MAX_CRTCS];
+  /* The CRTCs, followed by their extra pointers added later */
+  drm_crtc *crtcs;
   int num_crtcs;
+  int max_crtcs;
+  int max_pointers; /* Of each CRTC */
+
+  drm_plane **planes;
+  uint32_t num_planes;
 
   drmModePlaneResPtr pres;
   drmModeRes *res;
 
-  int prefer_afbc_modifier;
   int allow_overlay;
   int num_surfaces;
+  int pool_budget; /* KB, of the pools of other sizes */
   int inited;
   int atomic;
   int hide;
+  int idle_timeout;
+  int late_latch;
+  int frame_cache;
+  int reduced_depth; /* Tolerance of reduced-depth formats, -1 to disable */
+  int convert_budget; /* us, 0 for half a frame, -1 to disable */
+
+  /* Scheduling of the CRTC threads */
+  int sched_policy;
+  int sched_priority;
+  cpu_set_t cpu_affinity;
+  int timer_slack; /* us, -1 for the default */
+  uint32_t rotation; /* The rotation= override, 0 to follow the CRTCs */
+  uint64_t latch_margin;
   uint64_t min_interval;
 
+  /* Forwarding to the cursor daemon */
+  void *client;
+
+  /* Failed in-process inits after losing the daemon, retrying by backoff */
+  int init_fails;
+  uint64_t init_retry_time;
+
+  char *cache_dir; /* NULL to disable caches */
+
   float scale_x, scale_y;
   float scale_from;
-
-  char *configs;
 } drm_ctx;
 
-static drm_ctx g_drm_ctx = { 0, };
+/**
+ * Registry of device contexts, keyed by device identity.
+ * Entries are never freed, so the per-fd cache can be read without locking.
+ */
+static pthread_mutex_t g_drm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_drm_once = PTHREAD_ONCE_INIT;
+static drm_ctx *g_drm_ctxs = NULL;
+static drm_ctx *g_drm_fd_ctxs[DRM_MAX_FDS] = { NULL, };
+static char *g_drm_configs = NULL;
+static char *g_drm_stats_file = NULL;
+static uint64_t g_drm_stats_time = 0;
+static int g_drm_mlock = 0;
+static char *g_drm_daemon_socket = NULL;
+
+/* Direct input mode, moving the CRTC that the server moved last */
+static int g_drm_input = 0;
+static drm_crtc *g_drm_input_crtc = NULL;
+
 drm_private int g_drm_debug = 0;
 drm_private FILE *g_log_fp = NULL;
 
@@ -189,7 +545,86 @@ static inline uint64_t drm_curr_time(void)
   struct timeval tv;
 
   gettimeofday(&tv, NULL);
-  return tv.tv_sec + tv.tv_usec / 1000;
+  return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+static inline uint64_t drm_curr_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void drm_dump_stats(int force)
+{
+  uint64_t now = drm_curr_time_us() / 1000;
+  uint64_t last = __atomic_load_n(&g_drm_stats_time, __ATOMIC_RELAXED);
+  char tmp[PATH_MAX];
+  drm_ctx *ctx;
+  FILE *fp;
+
+  if (!g_drm_stats_file)
+    return;
+
+  if (!force && now - last < DRM_STATS_INTERVAL)
+    return;
+
+  /* Only one thread does the dumping */
+  if (!__atomic_compare_exchange_n(&g_drm_stats_time, &last, now, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", g_drm_stats_file);
+  fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+
+  for (ctx = __atomic_load_n(&g_drm_ctxs, __ATOMIC_ACQUIRE);
+       ctx; ctx = ctx->next) {
+    int num_crtcs = __atomic_load_n(&ctx->num_crtcs, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_crtcs; i++) {
+      drm_crtc *crtc = &ctx->crtcs[i];
+      drm_crtc_stats *stats = &crtc->stats;
+      drm_plane *plane = __atomic_load_n(&crtc->plane, __ATOMIC_ACQUIRE);
+
+      if (!plane)
+        continue;
+
+      fprintf(fp, "device: %d:%d CRTC[%d] pointer: %d plane: %d score: %d"
+              " mem: %"PRIu64
+              " trims: %"PRIu64" restores: %"PRIu64
+              " restore-us: %"PRIu64"/%"PRIu64
+              " latched: %"PRIu64" deadline: %"PRIu64"/%"PRIu64
+              " latch-us: %"PRIu64" margin-us: %"PRIu64
+              " latency-us: %"PRIu64"/%"PRIu64
+              " frames: %"PRIu64"/%"PRIu64" anim-frames: %"PRIu64
+              " reduced-frames: %"PRIu64" shared-frames: %"PRIu64
+              " atomic-tests: %"PRIu64" atomic-fallbacks: %"PRIu64
+              " convert-us: %"PRIu64"/%"PRIu64
+              " degrades: %"PRIu64" degraded-moves: %"PRIu64
+              " wake-us: %"PRIu64"/%"PRIu64"/%"PRIu64"\n",
+              major(ctx->rdev), minor(ctx->rdev), crtc->crtc_id,
+              crtc->pointer, plane->plane_id, stats->plane_score,
+              stats->mem_bytes,
+              stats->trims, stats->restores,
+              stats->last_restore_us, stats->max_restore_us,
+              stats->latched, stats->deadline_hits, stats->deadline_misses,
+              crtc->sched.latch_us, crtc->sched.margin_us,
+              stats->last_latency_us, stats->max_latency_us,
+              stats->frame_hits, stats->frame_misses, stats->anim_frames,
+              stats->reduced_frames, stats->shared_frames,
+              stats->atomic_tests, stats->atomic_fallbacks,
+              stats->avg_convert_us, stats->max_convert_us,
+              stats->degrades, stats->degraded_moves,
+              stats->last_wake_us,
+              stats->avg_wake_us, stats->max_wake_us);
+    }
+  }
+
+  fclose(fp);
+  rename(tmp, g_drm_stats_file);
 }
 
 static int drm_plane_get_prop(drm_ctx *ctx, drm_plane *plane, drm_plane_prop p)
@@ -200,6 +635,10 @@ static int drm_plane_get_prop(drm_ctx *ctx, drm_plane *plane, drm_plane_prop p)
   if (plane->prop_ids[p])
     return plane->prop_ids[p];
 
+  /* Not loaded yet for the planes from the cache */
+  if (!plane->props)
+    return -1;
+
   for (i = 0; i < plane->props->count_props; i++) {
     prop = drmModeGetProperty(ctx->fd, plane->props->props[i]);
     if (prop && !strcmp(prop->name, drm_plane_prop_names[p])) {
@@ -225,52 +664,254 @@ static int drm_atomic_add_plane_prop(drm_ctx *ctx, drmModeAtomicReq *request,
                                   plane->props->props[prop_idx], value);
 }
 
+#define drm_ctx_scaling(ctx) \
+  ((ctx)->scale_from || \
+   ((ctx)->scale_x && (ctx)->scale_x != 1.0) || \
+   ((ctx)->scale_y && (ctx)->scale_y != 1.0))
+
+#define drm_plane_use_atomic(ctx, crtc, plane) \
+  (!(plane)->cursor_plane && !(crtc)->async_commit && (ctx)->atomic)
+
+/* The rotation that the plane should apply */
+static uint32_t drm_crtc_plane_rotation(drm_ctx *ctx, drm_crtc *crtc)
+{
+  return crtc->rotation_mode == TRANSFORM_GL ?
+    DRM_MODE_ROTATE_0 : crtc->rotation;
+}
+
+/* The rotation that GL should render */
+static uint32_t drm_crtc_gl_rotation(drm_ctx *ctx, drm_crtc *crtc)
+{
+  return crtc->rotation_mode == TRANSFORM_GL ?
+    crtc->rotation : DRM_MODE_ROTATE_0;
+}
+
+/**
+ * The size of the converted FB, unscaled when the plane scales.
+ * It is in the unrotated coordinates.
+ */
+static void drm_crtc_get_fb_size(drm_crtc *crtc,
+                                 drm_cursor_state *cursor_state,
+                                 int *width, int *height)
+{
+  if (crtc->scaling_mode == TRANSFORM_GL) {
+    *width = cursor_state->scaled_w;
+    *height = cursor_state->scaled_h;
+  } else {
+    *width = cursor_state->width;
+    *height = cursor_state->height;
+  }
+}
+
+/* The plane's source size, in the FB's coordinates */
+static void drm_crtc_get_src_size(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state,
+                                  int *width, int *height)
+{
+  int tmp;
+
+  drm_crtc_get_fb_size(crtc, cursor_state, width, height);
+
+  /* Rotated by GL */
+  if (drm_crtc_gl_rotation(ctx, crtc) &
+      (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270)) {
+    tmp = *width;
+    *width = *height;
+    *height = tmp;
+  }
+}
+
+static int drm_atomic_add_plane(drm_ctx *ctx, drmModeAtomicReq *req,
+                                drm_crtc *crtc, drm_plane *plane, uint32_t fb,
+                                int x, int y, int w, int h,
+                                int src_w, int src_h)
+{
+  int ret = 0;
+
+  if (!fb) {
+    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_ID, 0);
+    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, 0);
+    return ret;
+  }
+
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane,
+                                   PLANE_PROP_CRTC_ID, crtc->crtc_id);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, fb);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_X, 0);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_Y, 0);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane,
+                                   PLANE_PROP_SRC_W, src_w << 16);
+  ret |= drm_atomic_add_plane_prop(ctx, req,
+                                   plane, PLANE_PROP_SRC_H, src_h << 16);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_X, x);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_Y, y);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_W, w);
+  ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_H, h);
+
+  if (crtc->rotation != DRM_MODE_ROTATE_0 &&
+      drm_plane_get_prop(ctx, plane, PLANE_PROP_rotation) >= 0)
+    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_rotation,
+                                     drm_crtc_plane_rotation(ctx, crtc));
+  return ret;
+}
+
+/* Commit the plane config by the TEST_ONLY flag */
+static int drm_atomic_test_plane(drm_ctx *ctx, drm_crtc *crtc,
+                                 drm_plane *plane, uint32_t fb,
+                                 int x, int y, int w, int h,
+                                 int src_w, int src_h)
+{
+  drmModeAtomicReq *req;
+  int ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -1;
+
+  ret = drm_atomic_add_plane(ctx, req, crtc, plane, fb,
+                             x, y, w, h, src_w, src_h);
+  if (ret >= 0)
+    ret = drmModeAtomicCommit(ctx->fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+  drmModeAtomicFree(req);
+  return ret < 0 ? -1 : 0;
+}
+
+static int drm_plane_verdict_match(drm_plane_verdict *verdict,
+                                   drm_plane_verdict *key)
+{
+  return verdict->crtc_id == key->crtc_id &&
+    verdict->format == key->format && verdict->modifier == key->modifier &&
+    verdict->rotation == key->rotation &&
+    verdict->w == key->w && verdict->h == key->h &&
+    verdict->src_w == key->src_w && verdict->src_h == key->src_h &&
+    verdict->clip == key->clip;
+}
+
+/* Find the cached verdict of the plane config, or test and cache it */
+static drm_plane_verdict *drm_crtc_check_config(drm_ctx *ctx, drm_crtc *crtc,
+                                                drm_plane *plane, uint32_t fb,
+                                                uint32_t format,
+                                                uint64_t modifier,
+                                                int x, int y, int w, int h,
+                                                int src_w, int src_h)
+{
+  drm_plane_verdict *verdict, key;
+
+  memset(&key, 0, sizeof(key));
+  key.crtc_id = crtc->crtc_id;
+  key.format = format;
+  key.modifier = modifier;
+  key.rotation = drm_crtc_plane_rotation(ctx, crtc);
+  key.w = w;
+  key.h = h;
+  key.src_w = src_w;
+  key.src_h = src_h;
+
+  /* The kernel clips the rect the same way inside of the CRTC */
+  if (x < 0)
+    key.clip |= DRM_CLIP_LEFT;
+  if (y < 0)
+    key.clip |= DRM_CLIP_TOP;
+  if (x + w > crtc->width)
+    key.clip |= DRM_CLIP_RIGHT;
+  if (y + h > crtc->height)
+    key.clip |= DRM_CLIP_BOTTOM;
+
+  for (int i = 0; i < DRM_MAX_VERDICTS; i++) {
+    verdict = &plane->verdicts[i];
+    if (drm_plane_verdict_match(verdict, &key))
+      return verdict;
+  }
+
+  key.ok = !drm_atomic_test_plane(ctx, crtc, plane, fb,
+                                  x, y, w, h, src_w, src_h);
+  crtc->stats.atomic_tests++;
+
+  if (!key.ok)
+    DRM_DEBUG("CRTC[%d]: plane: %d rejected %.4s:%#"PRIx64" (%dx%d) "
+              "from (%dx%d) clip: %#x\n", crtc->crtc_id, plane->plane_id,
+              (char *)&format, modifier, w, h, src_w, src_h, key.clip);
+
+  verdict = &plane->verdicts[plane->next_verdict];
+  plane->next_verdict = (plane->next_verdict + 1) % DRM_MAX_VERDICTS;
+  *verdict = key;
+  return verdict;
+}
+
+/* Exponential backoff (ms) after the failures, returns the retry time */
+static uint64_t drm_backoff(int *fails, int *backoff)
+{
+  *backoff = DRM_ATOMIC_BACKOFF_MIN << MIN(*fails, 7);
+  *backoff = MIN(*backoff, DRM_ATOMIC_BACKOFF_MAX);
+  (*fails)++;
+
+  return drm_curr_time_us() + *backoff * 1000ULL;
+}
+
+/* Use legacy commits for a while, re-probing by exponential backoff */
+static void drm_crtc_atomic_failed(drm_crtc *crtc)
+{
+  int backoff;
+
+  crtc->atomic_retry_time = drm_backoff(&crtc->atomic_fails, &backoff);
+
+  DRM_ERROR("CRTC[%d]: failed to do atomic commit (%d), "
+            "retry in %dms\n", crtc->crtc_id, errno, backoff);
+}
+
 static int drm_set_plane(drm_ctx *ctx, drm_crtc *crtc, drm_plane *plane,
-                         uint32_t fb, int x, int y, int w, int h)
+                         uint32_t fb, uint32_t format, uint64_t modifier,
+                         int x, int y, int w, int h, int src_w, int src_h)
 {
+  drm_plane_verdict *verdict = NULL;
   drmModeAtomicReq *req;
-  int ret = 0;
+  int ret;
+
+  crtc->commit_blocking = 0;
 
-  if (plane->cursor_plane || crtc->async_commit || !ctx->atomic)
+  if (!drm_plane_use_atomic(ctx, crtc, plane))
     goto legacy;
 
+  /* Backing off after failures */
+  if (crtc->atomic_retry_time > drm_curr_time_us())
+    goto fallback;
+
+  /* Configs rejected by the plane won't get any better by committing */
+  if (fb) {
+    verdict = drm_crtc_check_config(ctx, crtc, plane, fb, format, modifier,
+                                    x, y, w, h, src_w, src_h);
+    if (!verdict->ok)
+      goto fallback;
+  }
+
   req = drmModeAtomicAlloc();
   if (!req)
-    goto legacy;
+    goto fallback;
 
-  if (!fb) {
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_ID, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, 0);
-  } else {
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane,
-                                     PLANE_PROP_CRTC_ID, crtc->crtc_id);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, fb);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_X, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_Y, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane,
-                                     PLANE_PROP_SRC_W, w << 16);
-    ret |= drm_atomic_add_plane_prop(ctx, req,
-                                     plane, PLANE_PROP_SRC_H, h << 16);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_X, x);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_Y, y);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_W, w);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_H, h);
-  }
-
-  ret |= drmModeAtomicCommit(ctx->fd, req, DRM_MODE_ATOMIC_NONBLOCK, NULL);
+  ret = drm_atomic_add_plane(ctx, req, crtc, plane, fb,
+                             x, y, w, h, src_w, src_h);
+  if (ret >= 0)
+    ret = drmModeAtomicCommit(ctx->fd, req, DRM_MODE_ATOMIC_NONBLOCK, NULL);
   drmModeAtomicFree(req);
 
-  if (ret >= 0)
+  if (ret >= 0) {
+    if (crtc->atomic_fails)
+      DRM_INFO("CRTC[%d]: atomic commit recovered\n", crtc->crtc_id);
+    crtc->atomic_fails = 0;
     return 0;
+  }
+
+  /* Transient failures (e.g. EBUSY) keep the verdict */
+  if (verdict && errno == EINVAL)
+    verdict->ok = 0;
 
+  drm_crtc_atomic_failed(crtc);
+fallback:
+  crtc->stats.atomic_fallbacks++;
 legacy:
-  if (ret < 0 && ctx->atomic) {
-    DRM_ERROR("CRTC[%d]: failed to do atomic commit (%d)\n",
-              crtc->crtc_id, errno);
-    ctx->atomic = 0;
-  }
+  crtc->commit_blocking = 1;
   return drmModeSetPlane(ctx->fd, plane->plane_id, crtc->crtc_id, fb, 0,
-                         x, y, w, h, 0, 0, w << 16, h << 16);
+                         x, y, w, h, 0, 0, src_w << 16, src_h << 16);
 }
 
 static int drm_plane_get_prop_value(drm_ctx *ctx, drm_plane *plane,
@@ -304,14 +945,158 @@ static int drm_plane_set_prop_max(drm_ctx *ctx, drm_plane *plane,
   return 0;
 }
 
+static int drm_plane_set_prop(drm_ctx *ctx, drm_plane *plane,
+                              drm_plane_prop p, uint64_t value)
+{
+  int prop_idx = drm_plane_get_prop(ctx, plane, p);
+  if (prop_idx < 0)
+    return -1;
+
+  return drmModeObjectSetProperty(ctx->fd, plane->plane_id,
+                                  DRM_MODE_OBJECT_PLANE,
+                                  plane->props->props[prop_idx], value);
+}
+
+/* Get the supported bits of a bitmask prop */
+static uint64_t drm_plane_get_prop_bits(drm_ctx *ctx, drm_plane *plane,
+                                        drm_plane_prop p)
+{
+  drmModePropertyPtr prop;
+  uint64_t mask = 0;
+  int prop_idx = drm_plane_get_prop(ctx, plane, p);
+  if (prop_idx < 0)
+    return 0;
+
+  prop = drmModeGetProperty(ctx->fd, plane->props->props[prop_idx]);
+  if (!prop)
+    return 0;
+
+  if (prop->flags & DRM_MODE_PROP_BITMASK) {
+    for (int i = 0; i < prop->count_enums; i++)
+      mask |= 1ULL << prop->enums[i].value;
+  }
+
+  drmModeFreeProperty(prop);
+  return mask;
+}
+
+static int drm_plane_get_prop_range_max(drm_ctx *ctx, drm_plane *plane,
+                                        drm_plane_prop p, uint64_t *max)
+{
+  drmModePropertyPtr prop;
+  int prop_idx = drm_plane_get_prop(ctx, plane, p);
+  if (prop_idx < 0)
+    return -1;
+
+  prop = drmModeGetProperty(ctx->fd, plane->props->props[prop_idx]);
+  if (!prop)
+    return -1;
+
+  if (prop->flags & DRM_MODE_PROP_IMMUTABLE || !prop->count_values)
+    *max = plane->props->prop_values[prop_idx];
+  else
+    *max = prop->values[prop->count_values - 1];
+
+  drmModeFreeProperty(prop);
+  return 0;
+}
+
 static void drm_free_plane(drm_plane *plane)
 {
+  if (!plane)
+    return;
+
   drmModeFreeObjectProperties(plane->props);
-  drmModeFreePlane(plane->plane);
+  free(plane->formats);
   free(plane);
 }
 
-static void drm_plane_update_format(drm_ctx *ctx, drm_plane *plane)
+/**
+ * Formats with alpha, which the cursors could be converted into.
+ * The reduced-depth ones are only for the cursors that fit in them.
+ */
+static const struct {
+  uint32_t format;
+  int bpp;
+} drm_cursor_formats[] = {
+  { DRM_FORMAT_ARGB8888, 32 },
+  { DRM_FORMAT_ABGR8888, 32 },
+  { DRM_FORMAT_ARGB1555, 16 },
+  { DRM_FORMAT_ARGB4444, 16 },
+};
+
+static int drm_cursor_format_bpp(uint32_t format)
+{
+  for (uint32_t i = 0; i < ARRAY_SIZE(drm_cursor_formats); i++) {
+    if (drm_cursor_formats[i].format == format)
+      return drm_cursor_formats[i].bpp;
+  }
+
+  return 0;
+}
+
+/* Rank by scanout bandwidth, compressed > tiled > linear */
+static int drm_format_score(uint32_t format, uint64_t modifier)
+{
+  int score;
+
+  if (DRM_MOD_IS_AFBC(modifier)) {
+    score = 300;
+
+    /* Lossless color transform compresses better */
+    if (modifier & AFBC_FORMAT_MOD_YTR)
+      score += 20;
+
+    /* Split blocks only pay off for large buffers */
+    if (modifier & AFBC_FORMAT_MOD_SPLIT)
+      score -= 10;
+  } else if (modifier != DRM_FORMAT_MOD_LINEAR) {
+    score = 200;
+  } else {
+    score = 100;
+  }
+
+  /* Mali only support AFBC with BGR formats now */
+  if (DRM_MOD_IS_AFBC(modifier)) {
+    if (format == DRM_FORMAT_ABGR8888)
+      score += 1;
+  } else if (format == DRM_FORMAT_ARGB8888) {
+    /* The same layout as the cursor source */
+    score += 1;
+  }
+
+  return score;
+}
+
+static int drm_plane_add_format(drm_plane *plane, uint32_t format,
+                                uint64_t modifier)
+{
+  drm_plane_format *formats;
+
+  if (modifier == DRM_FORMAT_MOD_INVALID || !drm_cursor_format_bpp(format))
+    return 0;
+
+  formats = realloc(plane->formats,
+                    (plane->num_formats + 1) * sizeof(*formats));
+  if (!formats)
+    return -1;
+
+  plane->formats = formats;
+  formats[plane->num_formats].format = format;
+  formats[plane->num_formats].modifier = modifier;
+  formats[plane->num_formats].score = drm_format_score(format, modifier);
+  plane->num_formats++;
+  return 0;
+}
+
+static int drm_plane_format_cmp(const void *a, const void *b)
+{
+  return ((const drm_plane_format *)b)->score -
+    ((const drm_plane_format *)a)->score;
+}
+
+static void drm_plane_update_format(drm_ctx *ctx, drm_plane *plane,
+                                    drmModePlane *p)
 {
   drmModePropertyBlobPtr blob;
   struct drm_format_modifier_blob *header;
@@ -320,20 +1105,15 @@ static void drm_plane_update_format(drm_ctx *ctx, drm_plane *plane)
   uint64_t value;
   uint32_t i, j;
 
-  plane->can_afbc = plane->can_linear = 0;
-
-  /* Check formats */
-  for (i = 0; i < plane->plane->count_formats; i++) {
-    if (plane->plane->formats[i] == DRM_FORMAT_ARGB8888)
-      break;
-  }
-  if (i == plane->plane->count_formats)
-    return;
+  free(plane->formats);
+  plane->formats = NULL;
+  plane->num_formats = 0;
 
   if (drm_plane_get_prop_value(ctx, plane, PLANE_PROP_IN_FORMATS, &value) < 0) {
     /* No in_formats */
-    plane->can_linear = 1;
-    return;
+    for (i = 0; i < p->count_formats; i++)
+      drm_plane_add_format(plane, p->formats[i], DRM_FORMAT_MOD_LINEAR);
+    goto sort;
   }
 
   blob = drmModeGetPropertyBlob(ctx->fd, value);
@@ -345,63 +1125,92 @@ static void drm_plane_update_format(drm_ctx *ctx, drm_plane *plane)
   modifiers = (struct drm_format_modifier *)
     ((char *) header + header->modifiers_offset);
 
-  /* Check in_formats */
   for (i = 0; i < header->count_formats; i++) {
-    if (formats[i] == DRM_FORMAT_ARGB8888)
-      break;
-  }
-  if (i == header->count_formats)
-    goto out;
-
-  if (!header->count_modifiers) {
-    plane->can_linear = 1;
-    goto out;
-  }
-
-  /* Check modifiers */
-  for (j = 0; j < header->count_modifiers; j++) {
-    struct drm_format_modifier *mod = &modifiers[j];
-
-    if ((i < mod->offset) || (i > mod->offset + 63))
-      continue;
-    if (!(mod->formats & (1 << (i - mod->offset))))
+    if (!header->count_modifiers) {
+      drm_plane_add_format(plane, formats[i], DRM_FORMAT_MOD_LINEAR);
       continue;
+    }
+
+    for (j = 0; j < header->count_modifiers; j++) {
+      struct drm_format_modifier *mod = &modifiers[j];
 
-    if (mod->modifier == DRM_AFBC_MODIFIER)
-      plane->can_afbc = 1;
+      if ((i < mod->offset) || (i > mod->offset + 63))
+        continue;
+      if (!(mod->formats & (1ULL << (i - mod->offset))))
+        continue;
 
-    if (mod->modifier == DRM_FORMAT_MOD_LINEAR)
-      plane->can_linear = 1;
+      drm_plane_add_format(plane, formats[i], mod->modifier);
+    }
   }
 
-out:
   drmModeFreePropertyBlob(blob);
+sort:
+  qsort(plane->formats, plane->num_formats, sizeof(*plane->formats),
+        drm_plane_format_cmp);
+}
+
+static int drm_plane_load_props(drm_ctx *ctx, drm_plane *plane)
+{
+  if (plane->props)
+    return 0;
+
+  plane->props = drmModeObjectGetProperties(ctx->fd, plane->plane_id,
+                                            DRM_MODE_OBJECT_PLANE);
+  memset(plane->prop_ids, 0, sizeof(plane->prop_ids));
+  return plane->props ? 0 : -1;
 }
 
+/* Probe the plane's capabilities */
 static drm_plane *drm_get_plane(drm_ctx *ctx, uint32_t plane_id)
 {
+  drm_plane_caps *caps;
+  drmModePlane *p;
+  uint64_t value;
   drm_plane *plane = calloc(1, sizeof(*plane));
   if (!plane)
     return NULL;
 
   plane->plane_id = plane_id;
-  plane->plane = drmModeGetPlane(ctx->fd, plane_id);
-  if (!plane->plane)
+  caps = &plane->caps;
+
+  p = drmModeGetPlane(ctx->fd, plane_id);
+  if (!p)
     goto err;
 
-  plane->props = drmModeObjectGetProperties(ctx->fd, plane_id,
-                                            DRM_MODE_OBJECT_PLANE);
-  if (!plane->props)
+  caps->possible_crtcs = p->possible_crtcs;
+
+  if (drm_plane_load_props(ctx, plane) < 0)
     goto err;
 
-  drm_plane_update_format(ctx, plane);
+  if (drm_plane_get_prop_value(ctx, plane, PLANE_PROP_type, &value) < 0)
+    caps->type = -1;
+  else
+    caps->type = value;
+
+  if (!drm_plane_get_prop_range_max(ctx, plane, PLANE_PROP_zpos, &value) ||
+      !drm_plane_get_prop_range_max(ctx, plane, PLANE_PROP_ZPOS, &value))
+    caps->zpos_max = value < INT32_MAX ? value : INT32_MAX;
+  else
+    caps->zpos_max = -1;
+
+  caps->async_commit =
+    drm_plane_get_prop(ctx, plane, PLANE_PROP_ASYNC_COMMIT) >= 0;
+  caps->scaling_filter =
+    drm_plane_get_prop(ctx, plane, PLANE_PROP_SCALING_FILTER) >= 0;
+  caps->rotations = drm_plane_get_prop_bits(ctx, plane, PLANE_PROP_rotation);
+
+  plane->type = caps->type;
+
+  drm_plane_update_format(ctx, plane, p);
+  drmModeFreePlane(p);
   return plane;
 err:
+  drmModeFreePlane(p);
   drm_free_plane(plane);
   return NULL;
 }
 
-static void drm_load_configs(drm_ctx *ctx)
+static void drm_load_configs(void)
 {
   struct stat st;
   const char *file = DRM_CURSOR_CONFIG_FILE;
@@ -419,14 +1228,14 @@ static void drm_load_configs(drm_ctx *ctx)
   if (ptr == MAP_FAILED)
     goto out_close_fd;
 
-  ctx->configs = malloc(st.st_size + 1);
-  if (!ctx->configs)
+  g_drm_configs = malloc(st.st_size + 1);
+  if (!g_drm_configs)
     goto out_unmap;
 
-  memcpy(ctx->configs, ptr, st.st_size);
-  ctx->configs[st.st_size] = '\0';
+  memcpy(g_drm_configs, ptr, st.st_size);
+  g_drm_configs[st.st_size] = '\0';
 
-  tmp = ctx->configs;
+  tmp = g_drm_configs;
   while ((tmp = strchr(tmp, '#'))) {
     while (*tmp != '\n' && *tmp != '\0')
       *tmp++ = '\n';
@@ -438,15 +1247,15 @@ out_close_fd:
   close(fd);
 }
 
-static const char *drm_get_config(drm_ctx *ctx, const char *name)
+static const char *drm_get_config(const char *name)
 {
   static char buf[4096];
   const char *config;
 
-  if (!ctx->configs)
+  if (!g_drm_configs)
     return NULL;
 
-  config = strstr(ctx->configs, name);
+  config = strstr(g_drm_configs, name);
   if (!config)
     return NULL;
 
@@ -457,9 +1266,9 @@ static const char *drm_get_config(drm_ctx *ctx, const char *name)
   return buf;
 }
 
-static int drm_get_config_int(drm_ctx *ctx, const char *name, int def)
+static int drm_get_config_int(const char *name, int def)
 {
-  const char *config = drm_get_config(ctx, name);
+  const char *config = drm_get_config(name);
 
   if (config)
     return atoi(config);
@@ -467,80 +1276,506 @@ static int drm_get_config_int(drm_ctx *ctx, const char *name, int def)
   return def;
 }
 
-static drm_ctx *drm_get_ctx(int fd)
+/**
+ * Cache of the probed plane capabilities, keyed by the kernel, the driver
+ * and the object IDs of the device.
+ */
+
+#define DRM_CACHE_MAGIC 0x32504344 /* "DCP2", bump when changing the layout */
+#define DRM_CACHE_MAX_FORMATS 4096
+
+typedef struct {
+  uint32_t magic;
+  uint32_t num_planes;
+  uint64_t key;
+} drm_cache_header;
+
+typedef struct {
+  uint32_t plane_id;
+  uint32_t num_formats;
+  drm_plane_caps caps;
+} drm_cache_plane;
+
+static uint64_t drm_ctx_cache_key(drm_ctx *ctx)
+{
+  uint64_t hash = DRM_HASH_INIT;
+  drmVersionPtr version;
+  struct utsname uts;
+  char buf[1024];
+  int len;
+
+  version = drmGetVersion(ctx->fd);
+  if (!version || uname(&uts) < 0) {
+    drmFreeVersion(version);
+    return 0;
+  }
+
+  len = snprintf(buf, sizeof(buf), "%s %s %s %s %d.%d.%d %s",
+                 LIBDRM_CURSOR_VERSION, uts.release, uts.version,
+                 version->name, version->version_major,
+                 version->version_minor, version->version_patchlevel,
+                 version->date);
+  drmFreeVersion(version);
+
+  hash = drm_hash(hash, buf, MIN(len, (int)sizeof(buf)));
+  hash = drm_hash(hash, ctx->res->crtcs,
+                  ctx->res->count_crtcs * sizeof(*ctx->res->crtcs));
+  hash = drm_hash(hash, ctx->pres->planes,
+                  ctx->pres->count_planes * sizeof(*ctx->pres->planes));
+  return hash ? hash : 1;
+}
+
+static void drm_ctx_free_planes(drm_ctx *ctx)
+{
+  while (ctx->num_planes)
+    drm_free_plane(ctx->planes[--ctx->num_planes]);
+}
+
+static int drm_ctx_load_planes(drm_ctx *ctx, const char *path, uint64_t key)
+{
+  drm_cache_header header;
+  drm_cache_plane entry;
+  drm_plane *plane;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != DRM_CACHE_MAGIC || header.key != key ||
+      header.num_planes != ctx->pres->count_planes)
+    goto err;
+
+  for (uint32_t i = 0; i < header.num_planes; i++) {
+    if (fread(&entry, sizeof(entry), 1, fp) != 1 ||
+        entry.plane_id != ctx->pres->planes[i] ||
+        entry.num_formats > DRM_CACHE_MAX_FORMATS)
+      goto err;
+
+    plane = calloc(1, sizeof(*plane));
+    if (!plane)
+      goto err;
+
+    ctx->planes[ctx->num_planes++] = plane;
+    plane->plane_id = entry.plane_id;
+    plane->caps = entry.caps;
+    plane->type = entry.caps.type;
+
+    if (!entry.num_formats)
+      continue;
+
+    plane->formats = calloc(entry.num_formats, sizeof(*plane->formats));
+    if (!plane->formats ||
+        fread(plane->formats, sizeof(*plane->formats), entry.num_formats,
+              fp) != entry.num_formats)
+      goto err;
+
+    /* The scores are not part of the capabilities */
+    plane->num_formats = entry.num_formats;
+    for (int j = 0; j < plane->num_formats; j++)
+      plane->formats[j].score = drm_format_score(plane->formats[j].format,
+                                                 plane->formats[j].modifier);
+    qsort(plane->formats, plane->num_formats, sizeof(*plane->formats),
+          drm_plane_format_cmp);
+  }
+
+  fclose(fp);
+  DRM_INFO("loaded %d planes from cache: %s\n", ctx->num_planes, path);
+  return 0;
+err:
+  DRM_DEBUG("invalid or stale cache: %s\n", path);
+  fclose(fp);
+  drm_ctx_free_planes(ctx);
+  return -1;
+}
+
+static void drm_ctx_save_planes(drm_ctx *ctx, const char *dir,
+                                const char *path, uint64_t key)
+{
+  drm_cache_header header = {
+    .magic = DRM_CACHE_MAGIC,
+    .num_planes = ctx->num_planes,
+    .key = key,
+  };
+  char tmp[PATH_MAX];
+  FILE *fp;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+  fp = fopen(tmp, "wb");
+  if (!fp)
+    return;
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1)
+    goto err;
+
+  for (uint32_t i = 0; i < ctx->num_planes; i++) {
+    drm_plane *plane = ctx->planes[i];
+    drm_cache_plane entry = {
+      .plane_id = plane->plane_id,
+      .num_formats = plane->num_formats,
+      .caps = plane->caps,
+    };
+
+    if (fwrite(&entry, sizeof(entry), 1, fp) != 1 ||
+        fwrite(plane->formats, sizeof(*plane->formats), plane->num_formats,
+               fp) != (size_t)plane->num_formats)
+      goto err;
+  }
+
+  if (fclose(fp) || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return;
+  }
+
+  DRM_DEBUG("saved %d planes to cache: %s\n", ctx->num_planes, path);
+  return;
+err:
+  fclose(fp);
+  unlink(tmp);
+}
+
+/* Fetch all planes, from the cache when still valid */
+static void drm_ctx_init_planes(drm_ctx *ctx)
+{
+  char path[PATH_MAX];
+  uint64_t key = 0;
+
+  if (ctx->cache_dir) {
+    snprintf(path, sizeof(path), "%s/planes-%d-%d", ctx->cache_dir,
+             major(ctx->rdev), minor(ctx->rdev));
+
+    key = drm_ctx_cache_key(ctx);
+    if (key && !drm_ctx_load_planes(ctx, path, key))
+      return;
+  }
+
+  for (uint32_t i = 0; i < ctx->pres->count_planes; i++) {
+    drm_plane *plane = drm_get_plane(ctx, ctx->pres->planes[i]);
+    if (plane)
+      ctx->planes[ctx->num_planes++] = plane;
+  }
+
+  /* Only cache complete probes */
+  if (key && ctx->num_planes == ctx->pres->count_planes)
+    drm_ctx_save_planes(ctx, ctx->cache_dir, path, key);
+}
+
+/* Parse rotation like "rotate-90,reflect-x", as the plane prop names */
+static uint32_t drm_parse_rotation(const char *config)
+{
+  uint32_t rotation = DRM_MODE_ROTATE_0;
+
+  if (strstr(config, "rotate-90"))
+    rotation = DRM_MODE_ROTATE_90;
+  else if (strstr(config, "rotate-180"))
+    rotation = DRM_MODE_ROTATE_180;
+  else if (strstr(config, "rotate-270"))
+    rotation = DRM_MODE_ROTATE_270;
+
+  if (strstr(config, "reflect-x"))
+    rotation |= DRM_MODE_REFLECT_X;
+
+  if (strstr(config, "reflect-y"))
+    rotation |= DRM_MODE_REFLECT_Y;
+
+  return rotation;
+}
+
+static void drm_parse_sched(drm_ctx *ctx)
 {
-  drm_ctx *ctx = &g_drm_ctx;
-  uint32_t prefer_planes[DRM_MAX_CRTCS] = { 0, };
-  uint32_t prefer_plane = 0;
-  uint32_t i, max_fps, count_crtcs;
   const char *config;
+  int min, max;
+
+  ctx->sched_policy = SCHED_OTHER;
+  config = drm_get_config(OPT_SCHED_POLICY);
+  if (config && !strncmp(config, "fifo", 4))
+    ctx->sched_policy = SCHED_FIFO;
+  else if (config && !strncmp(config, "rr", 2))
+    ctx->sched_policy = SCHED_RR;
+
+  if (ctx->sched_policy != SCHED_OTHER) {
+    min = sched_get_priority_min(ctx->sched_policy);
+    max = sched_get_priority_max(ctx->sched_policy);
+
+    ctx->sched_priority = drm_get_config_int(OPT_SCHED_PRIORITY, min);
+    if (ctx->sched_priority < min)
+      ctx->sched_priority = min;
+    if (ctx->sched_priority > max)
+      ctx->sched_priority = max;
+
+    DRM_INFO("real-time scheduling: %s priority: %d\n",
+             ctx->sched_policy == SCHED_FIFO ? "fifo" : "rr",
+             ctx->sched_priority);
+  }
 
-  if (fd < 0)
-    return ctx;
+  CPU_ZERO(&ctx->cpu_affinity);
+  config = drm_get_config(OPT_CPU_AFFINITY);
+  while (config) {
+    int cpu = atoi(config);
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &ctx->cpu_affinity);
 
-  if (ctx->inited) {
-    /* Make sure the ctx's fd is the same as the input fd */
-    int flags = fcntl(ctx->fd, F_GETFL, 0);
-    if (fcntl(fd, F_GETFL, 0) == flags) {
-      fcntl(ctx->fd, F_SETFL, flags ^ O_NONBLOCK);
-      if (fcntl(fd, F_GETFL, 0) != flags) {
-        fcntl(ctx->fd, F_SETFL, flags);
-        return ctx;
-      }
+    config = strchr(config, ',');
+    if (config)
+      config++;
+  }
+
+  ctx->timer_slack = drm_get_config_int(OPT_TIMER_SLACK, -1);
+}
+
+/* Lock the library's own segments, or the whole process */
+static int drm_lock_segment(struct dl_phdr_info *info, size_t size, void *data)
+{
+  uintptr_t addr = (uintptr_t)data;
+  int i, found = 0;
+
+  for (i = 0; i < info->dlpi_phnum && !found; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+    found = phdr->p_type == PT_LOAD &&
+      addr >= start && addr < start + phdr->p_memsz;
+  }
+
+  if (!found)
+    return 0;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+
+    if (phdr->p_type == PT_LOAD && mlock((void *)start, phdr->p_memsz) < 0)
+      DRM_ERROR("failed to lock segment (%d)\n", errno);
+  }
+
+  return 1;
+}
+
+/* Lock the whole stack of the thread, created by DRM_THREAD_STACK_SIZE */
+static int drm_lock_stack(void)
+{
+  pthread_attr_t attr;
+  size_t size;
+  void *addr;
+  int ret = -1;
+
+  if (pthread_getattr_np(pthread_self(), &attr))
+    return -1;
+
+  if (!pthread_attr_getstack(&attr, &addr, &size))
+    ret = mlock(addr, size);
+
+  pthread_attr_destroy(&attr);
+  return ret;
+}
+
+static void drm_lock_memory(int mode)
+{
+  if (mode > 1) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      DRM_ERROR("failed to lock memory (%d)\n", errno);
+      return;
     }
 
-    close(ctx->fd);
-    ctx->fd = dup(fd);
-    return ctx;
+    DRM_INFO("locked process memory\n");
+  } else if (mode > 0) {
+    dl_iterate_phdr(drm_lock_segment, &g_drm_mlock);
+    DRM_INFO("locked library memory\n");
   }
+}
 
-  /* Failed already */
-  if (ctx->fd < 0)
-    return NULL;
+static int drm_yield_plane(uint32_t plane_id, int yield);
+static int drm_plane_busy(uint32_t plane_id);
+static int drm_start_input(void);
 
-  ctx->fd = dup(fd);
-  if (ctx->fd < 0)
-    return NULL;
+static void drm_start_control(void)
+{
+  const char *config;
+  struct group *gr;
+  char *path;
+  mode_t mode = 0600;
+  gid_t gid = -1;
+
+  if (!(config = drm_get_config(OPT_CONTROL_SOCKET)) ||
+      !(path = strdup(config)))
+    return;
+
+  /* Octal, e.g. 0660, 0 to keep the umask */
+  if ((config = drm_get_config(OPT_CONTROL_SOCKET_MODE)))
+    mode = strtol(config, NULL, 8);
 
-  drm_load_configs(ctx);
+  if ((config = drm_get_config(OPT_CONTROL_SOCKET_GROUP))) {
+    if (!(gr = getgrnam(config))) {
+      DRM_ERROR("control: unknown group: %s\n", config);
+      goto out;
+    }
+
+    gid = gr->gr_gid;
+  }
+
+  drm_control_start(path, mode, gid, drm_yield_plane, drm_plane_busy);
+out:
+  free(path);
+}
+
+static void drm_init_once(void)
+{
+  const char *config;
+  char *evdev = NULL;
+
+  drm_load_configs();
 
-  g_drm_debug = drm_get_config_int(ctx, OPT_DEBUG, 0);
+  g_drm_debug = drm_get_config_int(OPT_DEBUG, 0);
 
   if (getenv("DRM_DEBUG") || !access("/tmp/.drm_cursor_debug", F_OK))
     g_drm_debug = 1;
 
   if (!(config = getenv("DRM_CURSOR_LOG_FILE")))
-    config = drm_get_config(ctx, OPT_LOG_FILE);
+    config = drm_get_config(OPT_LOG_FILE);
 
   g_log_fp = fopen(config ? config : "/var/log/drm-cursor.log", "wb+");
 
-  ctx->atomic = drm_get_config_int(ctx, OPT_ATOMIC, 1);
-  DRM_INFO("atomic drm API %s\n", ctx->atomic ? "enabled" : "disabled");
+  if ((config = drm_get_config(OPT_STATS_FILE)))
+    g_drm_stats_file = strdup(config);
 
-  ctx->hide = drm_get_config_int(ctx, OPT_HIDE, 0);
-  if (ctx->hide)
-    DRM_INFO("invisible cursors\n");
+  DRM_INFO("using libdrm-cursor (%s)\n", LIBDRM_CURSOR_VERSION);
 
-#ifdef PREFER_AFBC_MODIFIER
-  ctx->prefer_afbc_modifier = 1;
+#ifndef DRM_CURSOR_DAEMON
+  /* The daemon owns the planes */
+  if ((config = drm_get_config(OPT_DAEMON_SOCKET))) {
+    g_drm_daemon_socket = strdup(config);
+    DRM_INFO("forwarding to cursor daemon: %s\n", config);
+    return;
+  }
 #endif
 
-  ctx->prefer_afbc_modifier =
-    drm_get_config_int(ctx, OPT_PREFER_AFBC, ctx->prefer_afbc_modifier);
+  g_drm_mlock = drm_get_config_int(OPT_MLOCK, 0);
+  drm_lock_memory(g_drm_mlock);
+
+  drm_start_control();
+
+  /* Read pointer events directly, bypassing the server */
+  /* Copy it, the config buffer is reused by starting the input */
+  config = drm_get_config(OPT_EVDEV);
+  if (config && (evdev = strdup(config)) && !drm_start_input()) {
+    for (config = evdev; config;) {
+      char path[PATH_MAX];
+      int fd;
+
+      snprintf(path, sizeof(path), "%.*s", (int)strcspn(config, ",\n"),
+               config);
+      fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      if (fd < 0 || drm_input_add_fd(fd) < 0) {
+        DRM_ERROR("failed to add input: %s\n", path);
+        if (fd >= 0)
+          close(fd);
+      }
+
+      config = strchr(config, ',');
+      if (config)
+        config++;
+    }
+  }
+
+  free(evdev);
+}
+
+/* Check whether the fds refer to the same open file (GEM handles are per-file) */
+static int drm_same_file(int fd1, int fd2)
+{
+  static int no_kcmp = 0;
+  int flags, ret;
+
+  if (fd1 == fd2)
+    return 1;
+
+  if (!no_kcmp) {
+    pid_t pid = getpid();
+
+    ret = syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+    if (ret >= 0)
+      return !ret;
+
+    if (errno != ENOSYS && errno != EPERM)
+      return 0;
+
+    DRM_DEBUG("kcmp not supported (%d), fallback to file flags\n", errno);
+    no_kcmp = 1;
+  }
+
+  /* The file status flags are shared by dup-ed fds */
+  flags = fcntl(fd1, F_GETFL, 0);
+  if (fcntl(fd2, F_GETFL, 0) != flags)
+    return 0;
+
+  fcntl(fd1, F_SETFL, flags ^ O_NONBLOCK);
+  ret = fcntl(fd2, F_GETFL, 0) != flags;
+  fcntl(fd1, F_SETFL, flags);
+  return ret;
+}
+
+static void drm_crtc_init_locks(drm_crtc *crtc)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&crtc->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_init(&crtc->mutex, NULL);
+}
+
+static void drm_ctx_init_locks(drm_ctx *ctx)
+{
+  pthread_condattr_t attr;
+
+  pthread_mutex_init(&ctx->mutex, NULL);
+  pthread_mutex_init(&ctx->frames_mutex, NULL);
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ctx->frames_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static int drm_init_ctx(drm_ctx *ctx)
+{
+  uint32_t *prefer_planes;
+  uint32_t prefer_plane = 0;
+  uint32_t i, max_fps, count_crtcs;
+  int max_surfaces, num_crtcs;
+  const char *config;
 
-  if (ctx->prefer_afbc_modifier)
-    DRM_DEBUG("prefer ARM AFBC modifier\n");
+  ctx->atomic = drm_get_config_int(OPT_ATOMIC, 1);
+  DRM_INFO("atomic drm API %s\n", ctx->atomic ? "enabled" : "disabled");
+
+  ctx->hide = drm_get_config_int(OPT_HIDE, 0);
+  if (ctx->hide)
+    DRM_INFO("invisible cursors\n");
 
-  ctx->allow_overlay = drm_get_config_int(ctx, OPT_ALLOW_OVERLAY, 0);
+  ctx->allow_overlay = drm_get_config_int(OPT_ALLOW_OVERLAY, 0);
 
   if (ctx->allow_overlay)
     DRM_DEBUG("allow overlay planes\n");
 
   drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 
-  ctx->num_surfaces = drm_get_config_int(ctx, OPT_NUM_SURFACES, 8);
+  ctx->num_surfaces = drm_get_config_int(OPT_NUM_SURFACES, 8);
 
-  max_fps = drm_get_config_int(ctx, OPT_MAX_FPS, 0);
+  ctx->pool_budget = drm_get_config_int(OPT_POOL_BUDGET, 1024);
+  if (ctx->pool_budget < 0)
+    ctx->pool_budget = 0;
+
+  ctx->idle_timeout = drm_get_config_int(OPT_IDLE_TIMEOUT, 0);
+  if (ctx->idle_timeout > 0)
+    DRM_INFO("release idle resources after %dms\n", ctx->idle_timeout);
+
+  max_fps = drm_get_config_int(OPT_MAX_FPS, 0);
   if (max_fps <= 0)
     max_fps = 60;
 
@@ -550,7 +1785,33 @@ static drm_ctx *drm_get_ctx(int fd)
 
   DRM_INFO("max fps: %d\n", max_fps);
 
-  config = drm_get_config(ctx, OPT_SCALE_FROM);
+  ctx->late_latch = drm_get_config_int(OPT_LATE_LATCH, 0);
+  ctx->latch_margin = drm_get_config_int(OPT_LATCH_MARGIN, 1000);
+  if (ctx->late_latch)
+    DRM_INFO("late latching with %"PRIu64"us margin\n", ctx->latch_margin);
+
+  drm_parse_sched(ctx);
+
+  ctx->frame_cache = drm_get_config_int(OPT_FRAME_CACHE, 16);
+  if (ctx->frame_cache > DRM_MAX_FRAMES)
+    ctx->frame_cache = DRM_MAX_FRAMES;
+
+  ctx->convert_budget = drm_get_config_int(OPT_CONVERT_BUDGET, 0);
+  if (ctx->convert_budget > 0)
+    DRM_INFO("conversion budget: %dus\n", ctx->convert_budget);
+
+  ctx->reduced_depth = drm_get_config_int(OPT_REDUCED_DEPTH, -1);
+  if (ctx->reduced_depth >= 0)
+    DRM_INFO("reduced-depth formats with tolerance: %d\n", ctx->reduced_depth);
+
+  ctx->rotation = 0;
+  config = drm_get_config(OPT_ROTATION);
+  if (config) {
+    ctx->rotation = drm_parse_rotation(config);
+    DRM_INFO("rotation override: %s (%#x)\n", config, ctx->rotation);
+  }
+
+  config = drm_get_config(OPT_SCALE_FROM);
   if (config) {
     int w, h, screen_w, screen_h;
     if (config &&
@@ -559,14 +1820,14 @@ static drm_ctx *drm_get_ctx(int fd)
       DRM_INFO("scale from: %s\n", config);
     }
   } else {
-    config = drm_get_config(ctx, OPT_SCALE);
+    config = drm_get_config(OPT_SCALE);
     if (config && sscanf(config, "%fx%f", &ctx->scale_x, &ctx->scale_y) == 2)
       DRM_INFO("scale: %s\n", config);
   }
 
   ctx->res = drmModeGetResources(ctx->fd);
   if (!ctx->res)
-    goto err_free_configs;
+    return -1;
 
   ctx->pres = drmModeGetPlaneResources(ctx->fd);
   if (!ctx->pres)
@@ -574,15 +1835,27 @@ static drm_ctx *drm_get_ctx(int fd)
 
   count_crtcs = ctx->res->count_crtcs;
 
+  ctx->max_pointers = drm_get_config_int(OPT_MAX_POINTERS, 4);
+  if (ctx->max_pointers < 1)
+    ctx->max_pointers = 1;
+
+  /* Room for the extra pointers */
+  ctx->max_crtcs = count_crtcs * ctx->max_pointers;
+  ctx->crtcs = calloc(ctx->max_crtcs, sizeof(*ctx->crtcs));
+  prefer_planes = calloc(count_crtcs, sizeof(*prefer_planes));
+  ctx->planes = calloc(ctx->pres->count_planes, sizeof(*ctx->planes));
+  if (!ctx->crtcs || !prefer_planes || !ctx->planes)
+    goto err_free_tables;
+
   /* Allow specifying prefer plane */
   if ((config = getenv("DRM_CURSOR_PREFER_PLANE")))
     prefer_plane = atoi(config);
   else
-    prefer_plane = drm_get_config_int(ctx, OPT_PREFER_PLANE, 0);
+    prefer_plane = drm_get_config_int(OPT_PREFER_PLANE, 0);
 
   /* Allow specifying prefer planes */
   if (!(config = getenv("DRM_CURSOR_PREFER_PLANES")))
-    config = drm_get_config(ctx, OPT_PREFER_PLANES);
+    config = drm_get_config(OPT_PREFER_PLANES);
   for (i = 0; config && i < count_crtcs; i++) {
     prefer_planes[i] = atoi(config);
 
@@ -599,9 +1872,11 @@ static drm_ctx *drm_get_ctx(int fd)
     if (!c)
       continue;
 
+    crtc->ctx = ctx;
     crtc->crtc_id = c->crtc_id;
     crtc->crtc_pipe = i;
     crtc->prefer_plane_id = prefer_planes[i] ? prefer_planes[i] : prefer_plane;
+    drm_crtc_init_locks(crtc);
 
     DRM_DEBUG("found %d CRTC: %d(%d) (%dx%d) prefer plane: %d\n",
               ctx->num_crtcs, c->crtc_id, i, c->width, c->height,
@@ -611,12 +1886,15 @@ static drm_ctx *drm_get_ctx(int fd)
     drmModeFreeCrtc(c);
   }
 
+  free(prefer_planes);
+  prefer_planes = NULL;
+
   DRM_DEBUG("found %d CRTCs\n", ctx->num_crtcs);
 
   if (!ctx->num_crtcs)
-    goto err_free_pres;
+    goto err_free_tables;
 
-  config = drm_get_config(ctx, OPT_CRTC_BLOCKLIST);
+  config = drm_get_config(OPT_CRTC_BLOCKLIST);
   for (i = 0; config && i < count_crtcs; i++) {
     uint32_t crtc_id = atoi(config);
 
@@ -634,121 +1912,462 @@ static drm_ctx *drm_get_ctx(int fd)
       config++;
   }
 
-  if (g_drm_debug) {
-    /* Dump planes for debugging */
-    for (i = 0; i < ctx->pres->count_planes; i++) {
-      drm_plane *plane = drm_get_plane(ctx, ctx->pres->planes[i]);
-      char *type;
-      uint64_t value = 0;
+  /* Share the pool budget between usable CRTCs */
+  max_surfaces = drm_get_config_int(OPT_MAX_SURFACES, 0);
+  for (i = 0, num_crtcs = 0; i < (uint32_t)ctx->num_crtcs; i++)
+    num_crtcs += !ctx->crtcs[i].blocked;
 
-      if (!plane)
-        continue;
+  if (max_surfaces > 0 && num_crtcs > 0 &&
+      ctx->num_surfaces * num_crtcs > max_surfaces) {
+    ctx->num_surfaces = max_surfaces / num_crtcs;
+    if (ctx->num_surfaces < 3)
+      ctx->num_surfaces = 3;
 
-      drm_plane_get_prop_value(ctx, plane, PLANE_PROP_type, &value);
-      switch (value) {
-      case DRM_PLANE_TYPE_PRIMARY:
-        type = "primary";
-        break;
-      case DRM_PLANE_TYPE_OVERLAY:
-        type = "overlay";
-        break;
-      case DRM_PLANE_TYPE_CURSOR:
-        type = "cursor ";
-        break;
-      default:
-        type = "unknown";
-        break;
-      }
+    DRM_INFO("limit to %d surfaces for each of %d CRTCs\n",
+             ctx->num_surfaces, num_crtcs);
+  }
+
+  config = drm_get_config(OPT_CACHE_DIR);
+  if (!config)
+    config = DRM_CURSOR_CACHE_DIR;
+  if (strcmp(config, "none"))
+    ctx->cache_dir = strdup(config);
 
-      DRM_DEBUG("found plane: %d[%s] crtcs: 0x%x %s%s\n",
-                plane->plane_id, type, plane->plane->possible_crtcs,
-                plane->can_linear ? "(ARGB)" : "",
-                plane->can_afbc ? "(AFBC)" : "");
+  drm_ctx_init_planes(ctx);
 
-      drm_free_plane(plane);
+  for (i = 0; i < ctx->num_planes; i++) {
+    drm_plane *plane = ctx->planes[i];
+    char *type;
+
+    switch (plane->type) {
+    case DRM_PLANE_TYPE_PRIMARY:
+      type = "primary";
+      break;
+    case DRM_PLANE_TYPE_OVERLAY:
+      type = "overlay";
+      break;
+    case DRM_PLANE_TYPE_CURSOR:
+      type = "cursor ";
+      break;
+    default:
+      type = "unknown";
+      break;
     }
+
+    DRM_DEBUG("found plane: %d[%s] crtcs: 0x%x formats: %d\n",
+              plane->plane_id, type, plane->caps.possible_crtcs,
+              plane->num_formats);
+
+    for (int j = 0; j < plane->num_formats; j++)
+      DRM_DEBUG("  %.4s:%#"PRIx64" score: %d\n",
+                (char *)&plane->formats[j].format,
+                plane->formats[j].modifier, plane->formats[j].score);
   }
 
-  DRM_INFO("using libdrm-cursor (%s)\n", LIBDRM_CURSOR_VERSION);
+  DRM_DEBUG("found %d planes\n", ctx->num_planes);
 
   ctx->inited = 1;
-  return ctx;
+  return 0;
 
-err_free_pres:
+err_free_tables:
+  for (i = 0; i < ctx->num_planes; i++)
+    drm_free_plane(ctx->planes[i]);
+  free(ctx->planes);
+  free(prefer_planes);
+  free(ctx->crtcs);
+  ctx->num_crtcs = ctx->num_planes = 0;
   drmModeFreePlaneResources(ctx->pres);
 err_free_res:
   drmModeFreeResources(ctx->res);
-err_free_configs:
-  free(ctx->configs);
-  close(ctx->fd);
-  ctx->fd = -1;
-  return NULL;
+  return -1;
 }
 
-#define drm_crtc_bind_plane_force(ctx, crtc, plane) \
-  drm_crtc_bind_plane(ctx, crtc, plane, 1)
+/* Slow path: find or create the device ctx for the fd, and cache it */
+static drm_ctx *drm_lookup_ctx(int fd)
+{
+  drm_ctx *ctx;
+  struct stat st;
 
-#define drm_crtc_bind_plane_cursor(ctx, crtc, plane) \
-  drm_crtc_bind_plane(ctx, crtc, plane, 0)
+  pthread_once(&g_drm_once, drm_init_once);
 
-static int drm_crtc_bind_plane(drm_ctx *ctx, drm_crtc *crtc, uint32_t plane_id,
-                               int allow_overlay)
-{
-  drm_plane *plane;
-  uint64_t value;
-  int i;
+  if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+    /* Reused by a non-device file */
+    if (fd < DRM_MAX_FDS)
+      __atomic_store_n(&g_drm_fd_ctxs[fd], NULL, __ATOMIC_RELEASE);
+    return NULL;
+  }
 
-  /* CRTC already assigned */
-  if (crtc->plane)
-    return 1;
+  pthread_mutex_lock(&g_drm_mutex);
 
-  /* Plane already assigned */
-  for (i = 0; i < ctx->num_crtcs; i++) {
-    if (ctx->crtcs[i].plane && ctx->crtcs[i].plane->plane_id == plane_id)
-      return -1;
+  for (ctx = g_drm_ctxs; ctx; ctx = ctx->next) {
+    if (ctx->rdev == st.st_rdev)
+      break;
   }
 
-  plane = drm_get_plane(ctx, plane_id);
-  if (!plane)
-    return -1;
+  if (!ctx) {
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+      goto out;
 
-  /* Unable to use */
-  if (!plane->can_afbc && !plane->can_linear)
-    goto err;
+    ctx->rdev = st.st_rdev;
+    ctx->fd = dup(fd);
+    drm_ctx_init_locks(ctx);
+
+    DRM_INFO("new device: %d:%d (fd: %d)\n",
+             major(ctx->rdev), minor(ctx->rdev), fd);
+
+    /* Fallback to the in-process cursors without the daemon */
+    if (ctx->fd >= 0 && g_drm_daemon_socket &&
+        (ctx->client = drm_client_connect(g_drm_daemon_socket, ctx->fd)))
+      ctx->inited = 1;
+    else if (ctx->fd >= 0 && drm_init_ctx(ctx) < 0) {
+      DRM_ERROR("failed to init device: %d:%d\n",
+                major(ctx->rdev), minor(ctx->rdev));
+      close(ctx->fd);
+      ctx->fd = -1;
+    }
 
-  /* Not for this CRTC */
-  if (!(plane->plane->possible_crtcs & (1 << crtc->crtc_pipe)))
-    goto err;
+    /* Failed devices are kept to avoid retrying */
+    ctx->next = g_drm_ctxs;
+    __atomic_store_n(&g_drm_ctxs, ctx, __ATOMIC_RELEASE);
+  } else if (ctx->inited && !drm_same_file(ctx->fd, fd)) {
+    /* Atomically re-point our fd to the new file, keeping the fd number */
+    if (dup3(fd, ctx->fd, O_CLOEXEC) < 0) {
+      DRM_ERROR("failed to switch fd (%d)\n", errno);
+    } else {
+      __atomic_add_fetch(&ctx->fd_gen, 1, __ATOMIC_RELEASE);
+      drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+      DRM_DEBUG("device: %d:%d switched to fd: %d\n",
+                major(ctx->rdev), minor(ctx->rdev), fd);
 
-  /* Not using primary planes */
-  if (drm_plane_get_prop_value(ctx, plane, PLANE_PROP_type, &value) < 0)
-    goto err;
+      if (ctx->client)
+        drm_client_set_fd(ctx->client, ctx->fd);
+    }
+  }
 
-  if (value == DRM_PLANE_TYPE_PRIMARY)
-    goto err;
+  if (fd < DRM_MAX_FDS)
+    __atomic_store_n(&g_drm_fd_ctxs[fd], ctx, __ATOMIC_RELEASE);
+
+out:
+  pthread_mutex_unlock(&g_drm_mutex);
+  return (ctx && ctx->inited) ? ctx : NULL;
+}
+
+/**
+ * Fast path: lock-free for cached fds, with a single fstat() since the fd
+ * might have been closed and its number reused for another file.
+ */
+static drm_ctx *drm_get_ctx(int fd)
+{
+  struct stat st;
+  drm_ctx *ctx;
+
+  if (fd < 0)
+    return NULL;
+
+  if (fd < DRM_MAX_FDS) {
+    ctx = __atomic_load_n(&g_drm_fd_ctxs[fd], __ATOMIC_ACQUIRE);
+    if (ctx && ctx->inited && !fstat(fd, &st) && S_ISCHR(st.st_mode) &&
+        st.st_rdev == ctx->rdev)
+      return ctx;
+  }
+
+  return drm_lookup_ctx(fd);
+}
+
+/* Dropped when the daemon is gone, see drm_ctx_drop_client() */
+#define drm_ctx_client(ctx) __atomic_load_n(&(ctx)->client, __ATOMIC_ACQUIRE)
+
+/**
+ * The daemon is gone (and reconnecting failed), fall back to the in-process
+ * cursors. Returns 0 when the ctx is not forwarding anymore.
+ */
+static int drm_ctx_drop_client(drm_ctx *ctx)
+{
+  void *client;
+
+  pthread_mutex_lock(&g_drm_mutex);
+
+  client = ctx->client;
+  if (client && !drm_client_connected(client) &&
+      ctx->init_retry_time <= drm_curr_time_us()) {
+    if (drm_init_ctx(ctx) < 0) {
+      int backoff = DRM_INIT_BACKOFF_MIN << MIN(ctx->init_fails, 6);
+
+      backoff = MIN(backoff, DRM_INIT_BACKOFF_MAX);
+      ctx->init_fails++;
+      ctx->init_retry_time = drm_curr_time_us() + backoff * 1000ULL;
+
+      DRM_ERROR("failed to init device: %d:%d, retry in %dms\n",
+                major(ctx->rdev), minor(ctx->rdev), backoff);
+    } else {
+      /* Publish it after initialized */
+      __atomic_store_n(&ctx->client, NULL, __ATOMIC_RELEASE);
+      drm_client_close(client);
+      DRM_INFO("device: %d:%d lost cursor daemon, using in-process cursors\n",
+               major(ctx->rdev), minor(ctx->rdev));
+    }
+  }
+
+  pthread_mutex_unlock(&g_drm_mutex);
+
+  return drm_ctx_client(ctx) ? -1 : 0;
+}
+
+/* Like drm_get_ctx(), but make sure that the fd's GEM handles are usable */
+static drm_ctx *drm_get_ctx_verified(int fd)
+{
+  drm_ctx *ctx = drm_get_ctx(fd);
+
+  if (ctx && drm_same_file(ctx->fd, fd))
+    return ctx;
+
+  return drm_lookup_ctx(fd);
+}
+
+/* Re-point the ctx to a new file of the device, releasing the fd's one */
+drm_private void drm_daemon_detach(int fd)
+{
+  drm_ctx *ctx;
+  char *name;
+  int new_fd;
+
+  if (fd < DRM_MAX_FDS)
+    __atomic_store_n(&g_drm_fd_ctxs[fd], NULL, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&g_drm_mutex);
+
+  for (ctx = g_drm_ctxs; ctx; ctx = ctx->next) {
+    if (!ctx->inited || !drm_same_file(ctx->fd, fd))
+      continue;
+
+    name = drmGetDeviceNameFromFd2(fd);
+    new_fd = name ? open(name, O_RDWR | O_CLOEXEC) : -1;
+    free(name);
+
+    if (new_fd < 0 || dup3(new_fd, ctx->fd, O_CLOEXEC) < 0) {
+      DRM_ERROR("failed to detach fd: %d (%d)\n", fd, errno);
+    } else {
+      __atomic_add_fetch(&ctx->fd_gen, 1, __ATOMIC_RELEASE);
+      drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+      DRM_INFO("device: %d:%d detached fd: %d\n",
+               major(ctx->rdev), minor(ctx->rdev), fd);
+    }
+
+    if (new_fd >= 0)
+      close(new_fd);
+  }
+
+  pthread_mutex_unlock(&g_drm_mutex);
+}
+
+static drm_plane *drm_ctx_get_plane(drm_ctx *ctx, uint32_t plane_id)
+{
+  uint32_t i;
+
+  for (i = 0; i < ctx->num_planes; i++) {
+    if (ctx->planes[i]->plane_id == plane_id)
+      return ctx->planes[i];
+  }
+
+  return NULL;
+}
+
+static int drm_crtc_plane_usable(drm_crtc *crtc, drm_plane *plane,
+                                 int allow_overlay)
+{
+  /* Plane already assigned */
+  if (plane->crtc_id)
+    return 0;
+
+  /* Lent to another client */
+  if (__atomic_load_n(&plane->yielded, __ATOMIC_ACQUIRE))
+    return 0;
+
+  /* Unable to use */
+  if (!plane->num_formats)
+    return 0;
+
+  /* Not for this CRTC */
+  if (!(plane->caps.possible_crtcs & (1 << crtc->crtc_pipe)))
+    return 0;
+
+  /* Not using primary planes */
+  if (plane->type < 0 || plane->type == DRM_PLANE_TYPE_PRIMARY)
+    return 0;
 
   /* Check for overlay plane */
-  if (!allow_overlay && value == DRM_PLANE_TYPE_OVERLAY)
-    goto err;
+  if (!allow_overlay && plane->type == DRM_PLANE_TYPE_OVERLAY)
+    return 0;
+
+  return 1;
+}
+
+/**
+ * Score the plane for the CRTC's cursor by its capabilities and the needed
+ * features, higher is faster. Returns -1 when unusable.
+ */
+static int drm_crtc_score_plane(drm_ctx *ctx, drm_crtc *crtc,
+                                drm_plane *plane, int allow_overlay)
+{
+  int score, linear = 0;
+
+  if (!drm_crtc_plane_usable(crtc, plane, allow_overlay))
+    return -1;
+
+  /* Scanout bandwidth of the best format */
+  score = plane->formats[0].score;
+
+  /* Legacy cursor updates are not throttled by vblanks */
+  if (plane->type == DRM_PLANE_TYPE_CURSOR)
+    score += 500;
+
+  /* Async commit of Rockchip BSP kernel */
+  if (plane->caps.async_commit)
+    score += 300;
+
+  /* Higher zpos is less likely to be covered */
+  if (plane->caps.zpos_max >= 0)
+    score += MIN(plane->caps.zpos_max, 16) * 5;
+
+  /* AFBC-only planes need the multi-surface corruption workaround */
+  for (int i = 0; i < plane->num_formats; i++)
+    linear |= plane->formats[i].modifier == DRM_FORMAT_MOD_LINEAR;
+  if (!linear)
+    score -= 50;
+
+  /* Saves rendering when able to rotate */
+  if (crtc->rotation != DRM_MODE_ROTATE_0 &&
+      (plane->caps.rotations & crtc->rotation) == crtc->rotation)
+    score += 100;
+
+  /* Cursor planes hardly scale, scaling filters hint a scaler */
+  if (drm_ctx_scaling(ctx)) {
+    if (plane->type == DRM_PLANE_TYPE_CURSOR)
+      score -= 200;
+    else if (plane->caps.scaling_filter)
+      score += 100;
+  }
+
+  return score;
+}
+
+/* Pick the best scored plane */
+static drm_plane *drm_crtc_select_plane(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_plane *best = NULL;
+  int score, best_score = -1;
+
+  for (uint32_t i = 0; i < ctx->num_planes; i++) {
+    score = drm_crtc_score_plane(ctx, crtc, ctx->planes[i],
+                                 ctx->allow_overlay);
+    DRM_DEBUG("CRTC[%d]: plane: %d score: %d\n",
+              crtc->crtc_id, ctx->planes[i]->plane_id, score);
+
+    if (score > best_score) {
+      best = ctx->planes[i];
+      best_score = score;
+    }
+  }
 
-  plane->cursor_plane = value == DRM_PLANE_TYPE_CURSOR;
+  return best;
+}
+
+/* The rotation of the CRTC's primary plane, e.g. for the panel orientation */
+static uint32_t drm_crtc_primary_rotation(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drmModeObjectPropertiesPtr props;
+  drmModePropertyPtr prop;
+  drmModePlanePtr p;
+  uint32_t rotation = DRM_MODE_ROTATE_0;
+  uint32_t i, j;
+  int on_crtc;
+
+  for (i = 0; i < ctx->num_planes; i++) {
+    drm_plane *plane = ctx->planes[i];
+
+    if (plane->type != DRM_PLANE_TYPE_PRIMARY ||
+        !(plane->caps.possible_crtcs & (1U << crtc->crtc_pipe)))
+      continue;
+
+    p = drmModeGetPlane(ctx->fd, plane->plane_id);
+    on_crtc = p && p->crtc_id == crtc->crtc_id;
+    drmModeFreePlane(p);
+    if (!on_crtc)
+      continue;
+
+    /* The current value, not the cached props */
+    props = drmModeObjectGetProperties(ctx->fd, plane->plane_id,
+                                       DRM_MODE_OBJECT_PLANE);
+    for (j = 0; props && j < props->count_props; j++) {
+      prop = drmModeGetProperty(ctx->fd, props->props[j]);
+      if (prop && !strcmp(prop->name, "rotation"))
+        rotation = props->prop_values[j];
+      drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    break;
+  }
+
+  return rotation;
+}
+
+static int drm_crtc_bind_plane(drm_ctx *ctx, drm_crtc *crtc, uint32_t plane_id)
+{
+  drm_plane *plane;
+
+  /* CRTC already assigned */
+  if (crtc->plane)
+    return 1;
+
+  plane = drm_ctx_get_plane(ctx, plane_id);
+  if (!plane)
+    return -1;
+
+  if (!drm_crtc_plane_usable(crtc, plane, 1))
+    return -1;
+
+  /* Cached planes come without props */
+  if (drm_plane_load_props(ctx, plane) < 0)
+    return -1;
+
+  plane->cursor_plane = plane->type == DRM_PLANE_TYPE_CURSOR;
   if (plane->cursor_plane)
     DRM_INFO("CRTC[%d]: using cursor plane\n", crtc->crtc_id);
 
-  if (ctx->prefer_afbc_modifier && plane->can_afbc)
-    crtc->use_afbc_modifier = 1;
-  else if (!plane->can_linear)
-    crtc->use_afbc_modifier = 1;
+  /* The legacy cursor ioctl moves the CRTC's own cursor plane */
+  crtc->legacy_move = plane->cursor_plane &&
+    plane->caps.possible_crtcs == 1U << crtc->crtc_pipe ? 0 : -1;
+  crtc->legacy_fails = 0;
+  crtc->legacy_retry_time = 0;
+  crtc->legacy_fb = 0;
+
+  crtc->unplugged = 0;
+  __atomic_store_n(&crtc->reselect, 0, __ATOMIC_RELEASE);
 
-  DRM_DEBUG("CRTC[%d]: bind plane: %d%s\n", crtc->crtc_id, plane->plane_id,
-            crtc->use_afbc_modifier ? "(AFBC)" : "");
+  /* Follow the primary plane, unless overridden */
+  crtc->rotation = ctx->rotation;
+  if (!crtc->rotation)
+    crtc->rotation = drm_crtc_primary_rotation(ctx, crtc);
+  if (crtc->rotation != DRM_MODE_ROTATE_0)
+    DRM_INFO("CRTC[%d]: rotation: %#x\n", crtc->crtc_id, crtc->rotation);
 
-  crtc->plane = plane;
+  crtc->atomic_fails = 0;
+  crtc->atomic_retry_time = 0;
+
+  /* Start from the best format */
+  crtc->format_idx = 0;
+  crtc->reduced_checked = crtc->reduced_rejected = 0;
+
+  crtc->stats.plane_score = drm_crtc_score_plane(ctx, crtc, plane, 1);
+  DRM_INFO("CRTC[%d]: bind plane: %d score: %d\n", crtc->crtc_id,
+           plane->plane_id, crtc->stats.plane_score);
+
+  plane->crtc_id = crtc->crtc_id;
+  __atomic_store_n(&crtc->plane, plane, __ATOMIC_RELEASE);
+  drm_dump_stats(1);
 
   return 0;
-err:
-  drm_free_plane(plane);
-  return -1;
 }
 
 static int drm_crtc_valid(drm_crtc *crtc)
@@ -770,177 +2389,1411 @@ static int drm_update_crtc(drm_ctx *ctx, drm_crtc *crtc)
   crtc->height = c->height;
   connected = drm_crtc_valid(crtc) >= 0;
 
+  if (c->mode_valid && c->mode.clock)
+    crtc->frame_us = 1000ULL * c->mode.htotal * c->mode.vtotal / c->mode.clock;
+  else
+    crtc->frame_us = 0;
+
   drmModeFreeCrtc(c);
 
   if (connected != was_connected)
     DRM_DEBUG("CRTC[%d]: %s!\n", crtc->crtc_id, \
               connected ? "connected" : "disconnected");
 
+  if (was_connected && !connected)
+    crtc->unplugged = 1;
+
   return drm_crtc_valid(crtc);
 }
 
-static int drm_crtc_update_offsets(drm_ctx *ctx, drm_crtc *crtc,
-                                   drm_cursor_state *cursor_state)
+/* The unrotated size, where the cursor positions are in */
+static void drm_crtc_get_size(drm_ctx *ctx, drm_crtc *crtc,
+                              int *width, int *height)
+{
+  if (crtc->rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270)) {
+    *width = crtc->height;
+    *height = crtc->width;
+  } else {
+    *width = crtc->width;
+    *height = crtc->height;
+  }
+}
+
+/* Transform a rect from the unrotated coordinates to the CRTC's */
+static void drm_crtc_rotate_rect(drm_ctx *ctx, drm_crtc *crtc,
+                                 int *x, int *y, int *w, int *h)
+{
+  int width, height, tmp;
+
+  drm_crtc_get_size(ctx, crtc, &width, &height);
+
+  /* Reflect before rotating, like the plane */
+  if (crtc->rotation & DRM_MODE_REFLECT_X)
+    *x = width - *x - *w;
+
+  if (crtc->rotation & DRM_MODE_REFLECT_Y)
+    *y = height - *y - *h;
+
+  /* Counter clockwise */
+  switch (crtc->rotation & DRM_MODE_ROTATE_MASK) {
+  case DRM_MODE_ROTATE_90:
+    tmp = *x;
+    *x = *y;
+    *y = width - tmp - *w;
+    break;
+  case DRM_MODE_ROTATE_180:
+    *x = width - *x - *w;
+    *y = height - *y - *h;
+    return;
+  case DRM_MODE_ROTATE_270:
+    tmp = *x;
+    *x = height - *y - *h;
+    *y = tmp;
+    break;
+  default:
+    return;
+  }
+
+  tmp = *w;
+  *w = *h;
+  *h = tmp;
+}
+
+static void drm_crtc_calc_offsets(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state)
 {
   int x, y, off_x, off_y, width, height, area_w, area_h;
+  int crtc_w, crtc_h;
   float scale_x, scale_y;
 
+  drm_crtc_get_size(ctx, crtc, &crtc_w, &crtc_h);
+
+  width = cursor_state->width;
+  height = cursor_state->height;
+
+  if (ctx->scale_from) {
+    scale_x = scale_y = ctx->scale_from * crtc_w * crtc_h / width / height;
+  } else {
+    scale_x = ctx->scale_x ? ctx->scale_x : 1.0;
+    scale_y = ctx->scale_y ? ctx->scale_y : 1.0;
+  }
+
+  width *= scale_x;
+  height *= scale_y;
+
+  x = cursor_state->x + cursor_state->hot_x - cursor_state->hot_x * scale_x;
+  y = cursor_state->y + cursor_state->hot_y - cursor_state->hot_y * scale_y;
+  area_w = crtc_w - width;
+  area_h = crtc_h - height;
+
+  off_x = off_y = 0;
+
+  if (x < 0)
+    off_x = x;
+
+  if (y < 0)
+    off_y = y;
+
+  if (x > area_w)
+    off_x = x - area_w;
+
+  if (y > area_h)
+    off_y = y - area_h;
+
+  cursor_state->scaled_x = x;
+  cursor_state->scaled_y = y;
+  cursor_state->off_x = off_x;
+  cursor_state->off_y = off_y;
+  cursor_state->scaled_w = width;
+  cursor_state->scaled_h = height;
+}
+
+static int drm_crtc_update_offsets(drm_ctx *ctx, drm_crtc *crtc,
+                                   drm_cursor_state *cursor_state)
+{
   if (drm_update_crtc(ctx, crtc) < 0)
     return -1;
 
-  width = cursor_state->width;
-  height = cursor_state->height;
+  drm_crtc_calc_offsets(ctx, crtc, cursor_state);
+  return 0;
+}
+
+static int drm_crtc_get_vblank(drm_ctx *ctx, drm_crtc *crtc,
+                               uint32_t *seq, uint64_t *time_us)
+{
+  drmVBlank vbl;
+
+  /* Query the last vblank, no event would be queued on the shared fd */
+  memset(&vbl, 0, sizeof(vbl));
+  vbl.request.type = DRM_VBLANK_RELATIVE;
+  if (crtc->crtc_pipe == 1)
+    vbl.request.type |= DRM_VBLANK_SECONDARY;
+  else if (crtc->crtc_pipe > 1)
+    vbl.request.type |= (crtc->crtc_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+      DRM_VBLANK_HIGH_CRTC_MASK;
+
+  if (drmWaitVBlank(ctx->fd, &vbl) < 0)
+    return -1;
+
+  *seq = vbl.reply.sequence;
+  *time_us = vbl.reply.tval_sec * 1000000ULL + vbl.reply.tval_usec;
+  return 0;
+}
+
+/* Account the latency from the expected wakeup to running */
+static void drm_crtc_update_wake(drm_crtc *crtc, uint64_t expected)
+{
+  drm_crtc_stats *stats = &crtc->stats;
+  uint64_t now = drm_curr_time_us();
+  uint64_t wake_us = now > expected ? now - expected : 0;
+
+  stats->last_wake_us = wake_us;
+  stats->avg_wake_us = stats->avg_wake_us ?
+    (stats->avg_wake_us * 15 + wake_us) / 16 : wake_us;
+  if (wake_us > stats->max_wake_us)
+    stats->max_wake_us = wake_us;
+}
+
+/* Sleep until right before the latch deadline of the next reachable vblank */
+static int drm_crtc_wait_deadline(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_crtc_sched *sched = &crtc->sched;
+  uint64_t now, vblank, deadline, latency, frames;
+  struct timespec ts;
+  uint32_t seq;
+
+  if (!crtc->frame_us || drm_crtc_get_vblank(ctx, crtc, &seq, &vblank) < 0)
+    return -1;
+
+  if (!sched->margin_us)
+    sched->margin_us = ctx->latch_margin;
+
+  now = drm_curr_time_us();
+  latency = sched->latch_us + sched->margin_us;
+
+  frames = 1;
+  if (now + latency > vblank)
+    frames = (now + latency - vblank) / crtc->frame_us + 1;
+
+  /* Only one commit for each vblank */
+  if (sched->has_target && (int32_t)(seq + frames - sched->target_seq) <= 0)
+    frames = sched->target_seq - seq + 1;
+
+  sched->target_seq = seq + frames;
+  sched->target_time = vblank + frames * crtc->frame_us;
+  sched->has_target = 1;
+
+  deadline = vblank + frames * crtc->frame_us - latency;
+  if (deadline <= now)
+    return 0;
+
+  ts.tv_sec = deadline / 1000000;
+  ts.tv_nsec = (deadline % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+  drm_crtc_update_wake(crtc, deadline);
+  return 0;
+}
+
+/* Update the latch estimation and adapt the margin after a commit */
+static void drm_crtc_update_sched(drm_ctx *ctx, drm_crtc *crtc,
+                                  uint64_t commit_start)
+{
+  drm_crtc_sched *sched = &crtc->sched;
+  uint64_t commit_us = drm_curr_time_us() - commit_start;
+  uint64_t vblank;
+  uint32_t seq;
+
+  /* Returned after the vblank by design, not a missed deadline */
+  if (crtc->commit_blocking)
+    return;
+
+  /* Slow commits would return after the latch */
+  if (commit_us > crtc->frame_us / 2)
+    commit_us = crtc->frame_us / 2;
+
+  sched->latch_us = (sched->latch_us * 7 + commit_us) / 8;
+
+  if (drm_crtc_get_vblank(ctx, crtc, &seq, &vblank) < 0)
+    return;
+
+  if ((int32_t)(seq - sched->target_seq) >= 0) {
+    /* The target vblank passed before the commit finished */
+    crtc->stats.deadline_misses++;
+    sched->margin_us += sched->margin_us / 2 + 250;
+    if (sched->margin_us > crtc->frame_us / 2)
+      sched->margin_us = crtc->frame_us / 2;
+
+    DRM_DEBUG("CRTC[%d]: missed deadline, margin: %"PRIu64"us\n",
+              crtc->crtc_id, sched->margin_us);
+  } else {
+    crtc->stats.deadline_hits++;
+
+    /* Decay back to the configured margin */
+    if (sched->margin_us > ctx->latch_margin)
+      sched->margin_us -= (sched->margin_us - ctx->latch_margin + 15) / 16;
+  }
+}
+
+/* Commit the newest position from cursor_next at the latch deadline */
+static int drm_crtc_late_latch(drm_ctx *ctx, drm_crtc *crtc,
+                               drm_cursor_state *cursor_state)
+{
+  drm_cursor_state latest;
+
+  if (drm_crtc_wait_deadline(ctx, crtc) < 0)
+    return -1;
+
+  pthread_mutex_lock(&crtc->mutex);
+  if (crtc->state != PENDING ||
+      crtc->cursor_next.request != REQ_MOVE_CURSOR) {
+    pthread_mutex_unlock(&crtc->mutex);
+    return 0;
+  }
+
+  latest = crtc->cursor_next;
+  pthread_mutex_unlock(&crtc->mutex);
+
+  /* Edge moving needs converting, leave it to the next round */
+  drm_crtc_calc_offsets(ctx, crtc, &latest);
+  if (latest.off_x != cursor_state->off_x ||
+      latest.off_y != cursor_state->off_y)
+    return 0;
+
+  pthread_mutex_lock(&crtc->mutex);
+  if (crtc->state == PENDING &&
+      crtc->cursor_next.request == REQ_MOVE_CURSOR &&
+      crtc->cursor_next.x == latest.x && crtc->cursor_next.y == latest.y) {
+    crtc->cursor_next.request = 0;
+    crtc->state = IDLE;
+  }
+  pthread_mutex_unlock(&crtc->mutex);
+
+  latest.request = 0;
+  latest.fb = cursor_state->fb;
+  *cursor_state = latest;
+  crtc->stats.latched++;
+  return 0;
+}
+
+/* Record what's on screen after a commit, for drm_cursor_query() */
+static void drm_crtc_update_presented(drm_ctx *ctx, drm_crtc *crtc,
+                                      int scheduled)
+{
+  drm_cursor_state *cursor_curr = &crtc->cursor_curr;
+  drm_crtc_stats *stats = &crtc->stats;
+  uint64_t present_time = drm_curr_time_us();
+  uint64_t vblank;
+  uint32_t seq;
+
+  if (scheduled) {
+    present_time = crtc->sched.target_time;
+  } else if (cursor_curr->timestamp && crtc->frame_us &&
+             !drm_crtc_get_vblank(ctx, crtc, &seq, &vblank)) {
+    /* Estimate it as the next vblank */
+    present_time = vblank + crtc->frame_us;
+  }
+
+  if (cursor_curr->timestamp && present_time > cursor_curr->timestamp) {
+    stats->last_latency_us = present_time - cursor_curr->timestamp;
+    if (stats->last_latency_us > stats->max_latency_us)
+      stats->max_latency_us = stats->last_latency_us;
+  }
+
+  pthread_mutex_lock(&crtc->mutex);
+  crtc->presented.visible = !!cursor_curr->fb;
+  crtc->presented.x = cursor_curr->x;
+  crtc->presented.y = cursor_curr->y;
+  crtc->presented.timestamp = cursor_curr->timestamp;
+  crtc->presented.present_time = present_time;
+  pthread_mutex_unlock(&crtc->mutex);
+}
+
+/**
+ * Move the cursor plane by the legacy cursor ioctl, keeping its FB.
+ * The kernel applies it asynchronously, while SetPlane might wait for vblank.
+ */
+static int drm_crtc_move_legacy(drm_ctx *ctx, drm_crtc *crtc, int x, int y)
+{
+  struct drm_mode_cursor arg;
+  int backoff;
+
+  if (crtc->legacy_move < 0)
+    return -1;
+
+  /* Backing off after failures */
+  if (crtc->legacy_retry_time > drm_curr_time_us())
+    return -1;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.flags = DRM_MODE_CURSOR_MOVE;
+  arg.crtc_id = crtc->crtc_id;
+  arg.x = x;
+  arg.y = y;
+
+  /* Not the hooked drmModeMoveCursor() */
+  if (drmIoctl(ctx->fd, DRM_IOCTL_MODE_CURSOR, &arg) < 0) {
+    crtc->legacy_retry_time = drm_backoff(&crtc->legacy_fails, &backoff);
+    DRM_INFO("CRTC[%d]: legacy cursor move failed (%d), retry in %dms\n",
+             crtc->crtc_id, errno, backoff);
+    return -1;
+  }
+
+  if (!crtc->legacy_move || crtc->legacy_fails) {
+    DRM_INFO("CRTC[%d]: moving by legacy cursor ioctl\n", crtc->crtc_id);
+    crtc->legacy_move = 1;
+    crtc->legacy_fails = 0;
+  }
+
+  return 0;
+}
+
+/* The legacy move resizes the plane to the FB, and can't crop or scale */
+static int drm_crtc_legacy_fits(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb,
+                                int w, int h, int src_w, int src_h)
+{
+  drmModeFBPtr info;
+
+  if (crtc->legacy_move < 0 || w != src_w || h != src_h)
+    return 0;
+
+  /* Query once for each FB on screen */
+  if (crtc->legacy_fb != fb) {
+    info = drmModeGetFB(ctx->fd, fb);
+    crtc->legacy_fb = fb;
+    crtc->legacy_fb_w = info ? (int)info->width : 0;
+    crtc->legacy_fb_h = info ? (int)info->height : 0;
+
+    /* Privileged callers get a GEM handle of it */
+    if (info && info->handle)
+      drmCloseBufferHandle(ctx->fd, info->handle);
+    drmModeFreeFB(info);
+  }
+
+  return src_w == crtc->legacy_fb_w && src_h == crtc->legacy_fb_h;
+}
+
+#define drm_crtc_disable_cursor(ctx, crtc) \
+  drm_crtc_update_cursor(ctx, crtc, NULL)
+
+static int drm_crtc_update_cursor(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state)
+{
+  drm_plane *plane = crtc->plane;
+  uint32_t old_fb = crtc->cursor_curr.fb;
+  uint32_t fb;
+  int x, y, w, h, src_w, src_h, ret;
+
+  crtc->commit_blocking = 0;
+
+  /* Disable */
+  if (!cursor_state) {
+    if (old_fb) {
+      DRM_DEBUG("CRTC[%d]: disabling cursor\n", crtc->crtc_id);
+      drm_set_plane(ctx, crtc, plane, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      if (!crtc->cursor_curr.cached)
+        egl_release_fb(ctx->fd, crtc->egl_ctx, old_fb);
+    }
+
+    memset(&crtc->cursor_curr, 0, sizeof(drm_cursor_state));
+    return 0;
+  }
+
+  /* Unchanged */
+  if (crtc->cursor_curr.fb == cursor_state->fb &&
+      crtc->cursor_curr.scaled_x == cursor_state->scaled_x &&
+      crtc->cursor_curr.scaled_y == cursor_state->scaled_y &&
+      crtc->cursor_curr.off_x == cursor_state->off_x &&
+      crtc->cursor_curr.off_y == cursor_state->off_y) {
+    crtc->cursor_curr = *cursor_state;
+    return 0;
+  }
+
+  fb = cursor_state->fb;
+  x = cursor_state->scaled_x - cursor_state->off_x;
+  y = cursor_state->scaled_y - cursor_state->off_y;
+  w = cursor_state->scaled_w;
+  h = cursor_state->scaled_h;
+
+  drm_crtc_rotate_rect(ctx, crtc, &x, &y, &w, &h);
+  drm_crtc_get_src_size(ctx, crtc, cursor_state, &src_w, &src_h);
+
+  /* Position only, the legacy move keeps the size unscaled */
+  if (old_fb == fb &&
+      drm_crtc_legacy_fits(ctx, crtc, fb, w, h, src_w, src_h) &&
+      !drm_crtc_move_legacy(ctx, crtc, x, y)) {
+    crtc->cursor_curr = *cursor_state;
+    return 0;
+  }
+
+  /* The FB ID might get reused after removed */
+  crtc->legacy_fb = 0;
+
+  DRM_DEBUG("CRTC[%d]: setting fb: %d (%dx%d) on plane: %d at (%d,%d)\n",
+            crtc->crtc_id, fb, w, h, plane->plane_id, x, y);
+
+  ret = drm_set_plane(ctx, crtc, plane, fb, cursor_state->format,
+                      cursor_state->modifier, x, y, w, h, src_w, src_h);
+  if (ret)
+    DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n", crtc->crtc_id, errno);
+
+  if (old_fb && old_fb != fb && !crtc->cursor_curr.cached) {
+    DRM_DEBUG("CRTC[%d]: remove FB: %d\n", crtc->crtc_id, old_fb);
+    egl_release_fb(ctx->fd, crtc->egl_ctx, old_fb);
+  }
+
+  crtc->cursor_curr = *cursor_state;
+  return ret;
+}
+
+/* Init EGL with the best usable format, falling back to the next ones */
+static int drm_crtc_init_egl(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_plane *plane = crtc->plane;
+  drm_plane_format *format;
+
+  if (crtc->egl_ctx)
+    return 0;
+
+  for (; crtc->format_idx < plane->num_formats; crtc->format_idx++) {
+    format = &plane->formats[crtc->format_idx];
+    if (drm_cursor_format_bpp(format->format) != 32)
+      continue;
+
+    crtc->egl_ctx = egl_init_ctx(ctx->fd, ctx->num_surfaces,
+                                 (uint64_t)ctx->pool_budget * 1024,
+                                 format->format, format->modifier,
+                                 ctx->cache_dir);
+    if (!crtc->egl_ctx)
+      continue;
+
+    if (crtc->trimmed)
+      return 0;
+
+    DRM_INFO("CRTC[%d]: using format: %.4s:%#"PRIx64"\n", crtc->crtc_id,
+             (char *)&format->format, format->modifier);
+    return 0;
+  }
+
+  DRM_ERROR("CRTC[%d]: failed to init egl ctx\n", crtc->crtc_id);
+  return -1;
+}
+
+/* Update memory accounting and restoring stats after converting */
+static void drm_crtc_converted(drm_crtc *crtc, uint64_t start)
+{
+  drm_crtc_stats *stats = &crtc->stats;
+
+  stats->mem_bytes = egl_get_mem_usage(crtc->egl_ctx) + crtc->frames_size;
+
+  if (!crtc->trimmed)
+    return;
+
+  crtc->trimmed = 0;
+  stats->restores++;
+  stats->last_restore_us = drm_curr_time_us() - start;
+  if (stats->last_restore_us > stats->max_restore_us)
+    stats->max_restore_us = stats->last_restore_us;
+
+  DRM_DEBUG("CRTC[%d]: restored in %"PRIu64"us\n",
+            crtc->crtc_id, stats->last_restore_us);
+  drm_dump_stats(1);
+}
+
+static uint64_t drm_crtc_convert_budget(drm_ctx *ctx, drm_crtc *crtc)
+{
+  if (ctx->convert_budget)
+    return ctx->convert_budget;
+
+  return (crtc->frame_us ? crtc->frame_us : 16667) / 2;
+}
+
+/* Recover when the average has enough headroom again */
+static void drm_crtc_check_recovery(drm_ctx *ctx, drm_crtc *crtc)
+{
+  if (crtc->degraded &&
+      crtc->budget_avg_us < drm_crtc_convert_budget(ctx, crtc) / 2) {
+    DRM_INFO("CRTC[%d]: conversion back in budget (%"PRIu64"us)\n",
+             crtc->crtc_id, crtc->budget_avg_us);
+    crtc->degraded = 0;
+  }
+}
+
+/**
+ * Account the conversion time, degrade when it's over the budget, and
+ * recover when the average has enough headroom again.
+ */
+static void drm_crtc_update_budget(drm_ctx *ctx, drm_crtc *crtc,
+                                   uint64_t start)
+{
+  drm_crtc_stats *stats = &crtc->stats;
+  uint64_t now = drm_curr_time_us();
+  uint64_t convert_us = now - start;
+  uint64_t budget;
+
+  stats->avg_convert_us = stats->avg_convert_us ?
+    (stats->avg_convert_us * 3 + convert_us) / 4 : convert_us;
+  if (convert_us > stats->max_convert_us)
+    stats->max_convert_us = convert_us;
+
+  crtc->budget_avg_us = crtc->budget_avg_us ?
+    (crtc->budget_avg_us * 3 + convert_us) / 4 : convert_us;
+  crtc->budget_time = now;
+
+  if (ctx->convert_budget < 0)
+    return;
+
+  budget = drm_crtc_convert_budget(ctx, crtc);
+  if (!crtc->degraded && convert_us > budget) {
+    DRM_INFO("CRTC[%d]: conversion took %"PRIu64"us, over %"PRIu64"us, "
+             "degrading\n", crtc->crtc_id, convert_us, budget);
+    crtc->degraded = 1;
+    stats->degrades++;
+  } else {
+    drm_crtc_check_recovery(ctx, crtc);
+  }
+}
+
+/**
+ * Degraded CRTCs convert rarely, so the average halves for every period
+ * without conversions, until recovering.
+ */
+static void drm_crtc_decay_budget(drm_ctx *ctx, drm_crtc *crtc)
+{
+  uint64_t now = drm_curr_time_us();
+  uint64_t periods = (now - crtc->budget_time) / DRM_BUDGET_DECAY_US;
+
+  if (!periods)
+    return;
+
+  crtc->budget_avg_us >>= MIN(periods, 63);
+  crtc->budget_time = now;
+  drm_crtc_check_recovery(ctx, crtc);
+}
+
+/**
+ * Cheaper edge moving when degraded: the offsets go by quarters of the
+ * cursor, keeping the FB between them, and the cursor clamps at the edge
+ * until the next step.
+ */
+static void drm_crtc_degrade_offsets(drm_ctx *ctx, drm_crtc *crtc,
+                                     drm_cursor_state *cursor_state)
+{
+  int crtc_w, crtc_h, step_x, step_y, off_x, off_y;
+
+  drm_crtc_get_size(ctx, crtc, &crtc_w, &crtc_h);
+
+  step_x = MAX(cursor_state->scaled_w / 4, 1);
+  step_y = MAX(cursor_state->scaled_h / 4, 1);
+
+  /* Rounded toward the screen */
+  off_x = cursor_state->off_x / step_x * step_x;
+  off_y = cursor_state->off_y / step_y * step_y;
+
+  cursor_state->scaled_x = off_x +
+    CLAMP(cursor_state->scaled_x - off_x, 0,
+          crtc_w - cursor_state->scaled_w);
+  cursor_state->scaled_y = off_y +
+    CLAMP(cursor_state->scaled_y - off_y, 0,
+          crtc_h - cursor_state->scaled_h);
+  cursor_state->off_x = off_x;
+  cursor_state->off_y = off_y;
+
+  crtc->stats.degraded_moves++;
+}
+
+static int drm_crtc_create_fb(drm_ctx *ctx, drm_crtc *crtc,
+                              drm_cursor_state *cursor_state)
+{
+  uint64_t start = drm_curr_time_us(), convert_start;
+  uint32_t handle = cursor_state->handle;
+  int width = cursor_state->width;
+  int height = cursor_state->height;
+  int off_x = cursor_state->off_x;
+  int off_y = cursor_state->off_y;
+  drm_plane_format *format;
+  int fb_w, fb_h;
+
+  drm_crtc_get_fb_size(crtc, cursor_state, &fb_w, &fb_h);
+
+  /* Offsets are in the scaled size */
+  if (fb_w != cursor_state->scaled_w)
+    off_x = off_x * fb_w / cursor_state->scaled_w;
+
+  if (fb_h != cursor_state->scaled_h)
+    off_y = off_y * fb_h / cursor_state->scaled_h;
+
+  DRM_DEBUG("CRTC[%d]: convert FB from %d (%dx%d) to (%dx%d) offset: (%d,%d)\n",
+            crtc->crtc_id, handle, width, height,
+            fb_w, fb_h, off_x, off_y);
+
+  if (drm_crtc_init_egl(ctx, crtc) < 0)
+    return -1;
+
+  format = &crtc->plane->formats[crtc->format_idx];
+  cursor_state->format = format->format;
+  cursor_state->modifier = format->modifier;
+  cursor_state->cached = 0;
+
+  convert_start = drm_curr_time_us();
+  cursor_state->fb =
+    egl_convert_fb(ctx->fd, crtc->egl_ctx, handle, width, height,
+                   fb_w, fb_h, off_x, off_y, drm_crtc_gl_rotation(ctx, crtc));
+  if (!cursor_state->fb) {
+    DRM_ERROR("CRTC[%d]: failed to create FB\n", crtc->crtc_id);
+    return -1;
+  }
+
+  drm_crtc_update_budget(ctx, crtc, convert_start);
+
+  drm_crtc_converted(crtc, start);
+
+  DRM_DEBUG("CRTC[%d]: created FB: %d\n", crtc->crtc_id, cursor_state->fb);
+  return 0;
+}
+
+/* Test the current transform modes with the converted FB */
+static int drm_crtc_test_plane(drm_ctx *ctx, drm_crtc *crtc,
+                               drm_cursor_state *cursor_state)
+{
+  drm_plane *plane = crtc->plane;
+  int x, y, w, h, src_w, src_h;
+
+  if (crtc->rotation_mode == TRANSFORM_PLANE &&
+      crtc->rotation != DRM_MODE_ROTATE_0 &&
+      (plane->caps.rotations & crtc->rotation) != crtc->rotation)
+    return -1;
+
+  if (!drm_plane_use_atomic(ctx, crtc, plane)) {
+    /* Unable to test scaling without TEST_ONLY */
+    if (crtc->scaling_mode == TRANSFORM_PLANE && drm_ctx_scaling(ctx))
+      return -1;
+
+    /* Legacy commits would keep the prop */
+    if (crtc->rotation_mode == TRANSFORM_PLANE &&
+        crtc->rotation != DRM_MODE_ROTATE_0)
+      return drm_plane_set_prop(ctx, plane, PLANE_PROP_rotation,
+                                crtc->rotation);
+    return 0;
+  }
+
+  x = cursor_state->scaled_x - cursor_state->off_x;
+  y = cursor_state->scaled_y - cursor_state->off_y;
+  w = cursor_state->scaled_w;
+  h = cursor_state->scaled_h;
+  drm_crtc_rotate_rect(ctx, crtc, &x, &y, &w, &h);
+  drm_crtc_get_src_size(ctx, crtc, cursor_state, &src_w, &src_h);
+
+  return drm_atomic_test_plane(ctx, crtc, plane, cursor_state->fb,
+                               x, y, w, h, src_w, src_h);
+}
+
+/* Channel error of rounding an 8-bit value into the bits, like GL does */
+static inline int drm_depth_error(int value, int bits)
+{
+  int max = (1 << bits) - 1;
+  int reduced = (value * max + 127) / 255;
+
+  return abs(value - (reduced * 255 + max / 2) / max);
+}
+
+/* Hash and analyze the cursor content, which is ARGB8888 */
+static int drm_bo_analyze(drm_ctx *ctx, uint32_t handle, int width, int height,
+                          drm_cursor_content *content)
+{
+  struct dma_buf_sync sync = { 0 };
+  uint64_t hash = DRM_HASH_INIT;
+  size_t i, size = (size_t)width * height * 4;
+  int a, err, analyze = ctx->reduced_depth >= 0;
+  uint32_t *ptr, pixel;
+  int dma_fd;
+
+  if (drmPrimeHandleToFD(ctx->fd, handle, DRM_CLOEXEC, &dma_fd) < 0)
+    return -1;
+
+  ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, dma_fd, 0);
+  if (ptr == MAP_FAILED) {
+    close(dma_fd);
+    return -1;
+  }
+
+  sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  content->err_1555 = content->err_4444 = 0;
+
+  for (i = 0; i < size / sizeof(*ptr); i++) {
+    pixel = ptr[i];
+    hash = drm_hash(hash, &pixel, sizeof(pixel));
+
+    if (!analyze)
+      continue;
+
+    /* Binary alpha for 1555 */
+    a = pixel >> 24;
+    err = a < 128 ? a : 255 - a;
+    if (err > content->err_1555)
+      content->err_1555 = err;
+
+    err = drm_depth_error(a, 4);
+    if (err > content->err_4444)
+      content->err_4444 = err;
+
+    /* Colors don't matter when transparent */
+    if (!a)
+      continue;
+
+    for (int shift = 0; shift < 24; shift += 8) {
+      int c = (pixel >> shift) & 0xff;
+
+      err = drm_depth_error(c, 5);
+      if (err > content->err_1555)
+        content->err_1555 = err;
+
+      err = drm_depth_error(c, 4);
+      if (err > content->err_4444)
+        content->err_4444 = err;
+    }
+  }
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  munmap(ptr, size);
+  close(dma_fd);
+
+  hash ^= (uint64_t)width << 32 | height;
+  content->hash = hash ? hash : 1;
+  return 0;
+}
+
+/* Find the plane's best format of the given one */
+static drm_plane_format *drm_plane_find_format(drm_plane *plane,
+                                               uint32_t format)
+{
+  for (int i = 0; i < plane->num_formats; i++) {
+    if (plane->formats[i].format == format)
+      return &plane->formats[i];
+  }
+
+  return NULL;
+}
+
+static int drm_cursor_format_idx(uint32_t format)
+{
+  for (uint32_t i = 0; i < ARRAY_SIZE(drm_cursor_formats); i++) {
+    if (drm_cursor_formats[i].format == format)
+      return i;
+  }
+
+  return 0;
+}
+
+/* Pick a reduced-depth format when the content fits in it */
+static drm_plane_format *drm_crtc_pick_format(drm_ctx *ctx, drm_crtc *crtc,
+                                              drm_cursor_content *content)
+{
+  drm_plane *plane = crtc->plane;
+  drm_plane_format *format = &plane->formats[crtc->format_idx];
+  drm_plane_format *reduced = NULL;
+  uint32_t candidate;
+
+  /* Only after the plane got probed, and able to test the formats */
+  if (ctx->reduced_depth < 0 || crtc->rotation_mode == TRANSFORM_UNKNOWN ||
+      !drm_plane_use_atomic(ctx, crtc, plane))
+    return format;
+
+  /* Prefer 1555 for more color bits */
+  if (content->err_1555 <= ctx->reduced_depth &&
+      content->err_1555 <= content->err_4444)
+    candidate = DRM_FORMAT_ARGB1555;
+  else if (content->err_4444 <= ctx->reduced_depth)
+    candidate = DRM_FORMAT_ARGB4444;
+  else
+    return format;
+
+  if (!(crtc->reduced_rejected & (1 << drm_cursor_format_idx(candidate))))
+    reduced = drm_plane_find_format(plane, candidate);
+
+  return reduced ? reduced : format;
+}
+
+/* Validate the reduced-depth format with the plane for the first time */
+static int drm_crtc_check_reduced(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state,
+                                  drm_plane_format *format, uint32_t fb)
+{
+  drm_cursor_state test_state = *cursor_state;
+  uint32_t bit = 1 << drm_cursor_format_idx(format->format);
+
+  if (crtc->reduced_checked & bit)
+    return 0;
+
+  test_state.fb = fb;
+  if (drm_crtc_test_plane(ctx, crtc, &test_state) < 0)
+    return -1;
+
+  DRM_INFO("CRTC[%d]: using reduced-depth format: %.4s:%#"PRIx64"\n",
+           crtc->crtc_id, (char *)&format->format, format->modifier);
+  crtc->reduced_checked |= bit;
+  return 0;
+}
+
+static void drm_crtc_free_frame(drm_ctx *ctx, drm_crtc *crtc,
+                                drm_cursor_frame *frame)
+{
+  /* Keep the FB on screen, it would be removed when replaced */
+  int on_screen = crtc->cursor_curr.cached && crtc->cursor_curr.fb == frame->fb;
+
+  if (on_screen)
+    crtc->cursor_curr.cached = 0;
+
+  pthread_mutex_lock(&ctx->frames_mutex);
+  egl_free_buffer(ctx->fd, frame->buffer, on_screen);
+  crtc->frames_size -= frame->size;
+  memset(frame, 0, sizeof(*frame));
+  pthread_mutex_unlock(&ctx->frames_mutex);
+}
+
+static void drm_crtc_free_frames(drm_ctx *ctx, drm_crtc *crtc)
+{
+  if (!crtc->frames)
+    return;
+
+  for (int i = 0; i < DRM_MAX_FRAMES; i++) {
+    if (crtc->frames[i].buffer)
+      drm_crtc_free_frame(ctx, crtc, &crtc->frames[i]);
+  }
+}
+
+static void drm_crtc_unpin_frames(drm_crtc *crtc)
+{
+  if (!crtc->frames)
+    return;
+
+  for (int i = 0; i < DRM_MAX_FRAMES; i++)
+    crtc->frames[i].pinned = 0;
+}
+
+/* Find a free slot, evicting the LRU unpinned frame when needed */
+static drm_cursor_frame *drm_crtc_alloc_frame(drm_ctx *ctx, drm_crtc *crtc,
+                                              int pin)
+{
+  drm_cursor_frame *frame, *free_frame = NULL, *lru = NULL;
+  int unpinned = 0;
+
+  for (int i = 0; i < DRM_MAX_FRAMES; i++) {
+    frame = &crtc->frames[i];
+    if (!frame->buffer) {
+      if (!free_frame)
+        free_frame = frame;
+      continue;
+    }
+
+    if (frame->pinned)
+      continue;
+
+    unpinned++;
+    if (!lru || frame->last_used < lru->last_used)
+      lru = frame;
+  }
+
+  if (free_frame && (pin || unpinned < ctx->frame_cache))
+    return free_frame;
+
+  if (!lru)
+    return NULL;
+
+  DRM_DEBUG("CRTC[%d]: evict frame: %d\n", crtc->crtc_id, lru->fb);
+  drm_crtc_free_frame(ctx, crtc, lru);
+  return lru;
+}
+
+static int drm_cursor_frame_match(drm_cursor_frame *frame,
+                                  drm_cursor_frame *key)
+{
+  return frame->hash == key->hash &&
+    frame->format == key->format && frame->modifier == key->modifier &&
+    frame->width == key->width && frame->height == key->height &&
+    frame->fb_w == key->fb_w && frame->fb_h == key->fb_h &&
+    frame->rotation == key->rotation;
+}
+
+/**
+ * Share the frame converted by another CRTC with the same format and size,
+ * e.g. when cloned, by a FB of our own.
+ * Waits for the CRTC already converting it, otherwise publishes the slot as
+ * pending for the others to wait for ours.
+ */
+static void *drm_crtc_share_frame(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_frame *key,
+                                  drm_cursor_frame *slot, uint32_t *fb)
+{
+  drm_cursor_frame *frame;
+  drm_crtc *other;
+  struct timespec ts;
+  void *buffer = NULL;
+  int pending;
+
+  int num_crtcs = __atomic_load_n(&ctx->num_crtcs, __ATOMIC_ACQUIRE);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_nsec += DRM_SHARE_TIMEOUT_MS * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&ctx->frames_mutex);
+retry:
+  pending = 0;
+  for (int i = 0; i < num_crtcs && !buffer; i++) {
+    other = &ctx->crtcs[i];
+    if (other == crtc || !other->frames)
+      continue;
+
+    for (int j = 0; j < DRM_MAX_FRAMES && !buffer; j++) {
+      frame = &other->frames[j];
+      if (!drm_cursor_frame_match(frame, key))
+        continue;
+
+      if (frame->buffer)
+        buffer = egl_share_buffer(ctx->fd, frame->buffer, fb);
+      else if (frame->pending)
+        pending = 1;
+    }
+  }
+
+  if (!buffer && pending &&
+      !pthread_cond_timedwait(&ctx->frames_cond, &ctx->frames_mutex, &ts))
+    goto retry;
+
+  if (!buffer) {
+    *slot = *key;
+    slot->pending = 1;
+  }
+  pthread_mutex_unlock(&ctx->frames_mutex);
+
+  if (buffer)
+    DRM_DEBUG("CRTC[%d]: shared FB: %d from CRTC[%d]\n",
+              crtc->crtc_id, *fb, other->crtc_id);
+
+  return buffer;
+}
+
+/* Drop the pending frame on failures, the waiters convert it themselves */
+static void drm_crtc_drop_pending(drm_ctx *ctx, drm_cursor_frame *frame)
+{
+  pthread_mutex_lock(&ctx->frames_mutex);
+  if (frame->pending) {
+    memset(frame, 0, sizeof(*frame));
+    pthread_cond_broadcast(&ctx->frames_cond);
+  }
+  pthread_mutex_unlock(&ctx->frames_mutex);
+}
+
+/* Get the cursor FB from the frame cache, converting it when missing */
+static int drm_crtc_get_cached_fb(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state, int pin)
+{
+  uint64_t start = drm_curr_time_us(), convert_start;
+  drm_plane_format *base, *format;
+  drm_cursor_content content;
+  drm_cursor_frame *frame, key;
+  uint64_t size = 0;
+  uint32_t fb = 0;
+  void *buffer;
+  int fb_w, fb_h, shared;
+
+  drm_crtc_get_fb_size(crtc, cursor_state, &fb_w, &fb_h);
+
+  if (!crtc->frames) {
+    frame = calloc(DRM_MAX_FRAMES, sizeof(*crtc->frames));
+    if (!frame)
+      return -1;
+
+    pthread_mutex_lock(&ctx->frames_mutex);
+    crtc->frames = frame;
+    pthread_mutex_unlock(&ctx->frames_mutex);
+  }
+
+  if (drm_bo_analyze(ctx, cursor_state->handle, cursor_state->width,
+                     cursor_state->height, &content) < 0)
+    return -1;
+
+  if (drm_crtc_init_egl(ctx, crtc) < 0)
+    return -1;
+
+  memset(&key, 0, sizeof(key));
+  key.hash = content.hash;
+  key.width = cursor_state->width;
+  key.height = cursor_state->height;
+  key.fb_w = fb_w;
+  key.fb_h = fb_h;
+  key.rotation = drm_crtc_gl_rotation(ctx, crtc);
+
+  base = &crtc->plane->formats[crtc->format_idx];
+  format = drm_crtc_pick_format(ctx, crtc, &content);
+retry:
+  key.format = format->format;
+  key.modifier = format->modifier;
+
+  for (int i = 0; i < DRM_MAX_FRAMES; i++) {
+    frame = &crtc->frames[i];
+    if (!frame->buffer || !drm_cursor_frame_match(frame, &key))
+      continue;
+
+    DRM_DEBUG("CRTC[%d]: reuse cached FB: %d\n", crtc->crtc_id, frame->fb);
+    goto out;
+  }
+
+  frame = drm_crtc_alloc_frame(ctx, crtc, pin);
+  if (!frame)
+    return -1;
+
+  buffer = drm_crtc_share_frame(ctx, crtc, &key, frame, &fb);
+  shared = !!buffer;
+  if (!shared) {
+    convert_start = drm_curr_time_us();
+    buffer = egl_convert_buffer(ctx->fd, crtc->egl_ctx, cursor_state->handle,
+                                cursor_state->width, cursor_state->height,
+                                fb_w, fb_h, 0, 0, key.rotation,
+                                format->format, format->modifier,
+                                &fb, &size);
+    if (buffer)
+      drm_crtc_update_budget(ctx, crtc, convert_start);
+  }
+
+  if (format != base &&
+      (!buffer ||
+       drm_crtc_check_reduced(ctx, crtc, cursor_state, format, fb) < 0)) {
+    DRM_INFO("CRTC[%d]: reduced-depth format: %.4s:%#"PRIx64" rejected\n",
+             crtc->crtc_id, (char *)&format->format, format->modifier);
+    crtc->reduced_rejected |= 1 << drm_cursor_format_idx(format->format);
+
+    if (buffer)
+      egl_free_buffer(ctx->fd, buffer, 0);
+
+    drm_crtc_drop_pending(ctx, frame);
+    format = base;
+    goto retry;
+  }
+
+  if (!buffer) {
+    DRM_ERROR("CRTC[%d]: failed to convert frame\n", crtc->crtc_id);
+    drm_crtc_drop_pending(ctx, frame);
+    return -1;
+  }
+
+  if (format != base)
+    crtc->stats.reduced_frames++;
+
+  /* Publish it to the other CRTCs */
+  pthread_mutex_lock(&ctx->frames_mutex);
+  *frame = key;
+  frame->buffer = buffer;
+  frame->fb = fb;
+  frame->size = size;
+  pthread_cond_broadcast(&ctx->frames_cond);
+  pthread_mutex_unlock(&ctx->frames_mutex);
+
+  crtc->frames_size += frame->size;
+  if (shared)
+    crtc->stats.shared_frames++;
+  else
+    crtc->stats.frame_misses++;
+
+  drm_crtc_converted(crtc, start);
+
+  DRM_DEBUG("CRTC[%d]: cached frame FB: %d\n", crtc->crtc_id, frame->fb);
+  goto done;
+out:
+  crtc->stats.frame_hits++;
+done:
+  frame->last_used = start;
+  frame->pinned |= pin;
+  cursor_state->fb = frame->fb;
+  cursor_state->format = frame->format;
+  cursor_state->modifier = frame->modifier;
+  cursor_state->cached = 1;
+  return 0;
+}
+
+/* Get the cursor FB, prefer the frame cache when possible */
+static int drm_crtc_get_fb(drm_ctx *ctx, drm_crtc *crtc,
+                           drm_cursor_state *cursor_state, int pin)
+{
+  /* Edge moving FBs are not worth caching */
+  if ((ctx->frame_cache || pin) &&
+      !cursor_state->off_x && !cursor_state->off_y &&
+      !drm_crtc_get_cached_fb(ctx, crtc, cursor_state, pin))
+    return 0;
+
+  return drm_crtc_create_fb(ctx, crtc, cursor_state);
+}
+
+/**
+ * Probe whether the plane could do the rotation and scaling, preferring it
+ * over GL rendering. The FB is converted again when the modes changed.
+ * Returns 1 when the plane rejected the format.
+ */
+static int drm_crtc_probe_transforms(drm_ctx *ctx, drm_crtc *crtc,
+                                     drm_cursor_state *cursor_state)
+{
+  int rotating = crtc->rotation != DRM_MODE_ROTATE_0;
+  int scaling = drm_ctx_scaling(ctx);
+  int i;
+
+  /* The FB was converted by plane modes */
+  crtc->rotation_mode = crtc->scaling_mode = TRANSFORM_PLANE;
+
+  /* Try plane/plane, plane/GL, GL/plane then GL/GL */
+  for (i = 0; i < 4; i++) {
+    drm_transform_mode rotation_mode = i & 2 ? TRANSFORM_GL : TRANSFORM_PLANE;
+    drm_transform_mode scaling_mode = i & 1 ? TRANSFORM_GL : TRANSFORM_PLANE;
+
+    if ((!rotating && rotation_mode == TRANSFORM_GL) ||
+        (!scaling && scaling_mode == TRANSFORM_GL))
+      continue;
+
+    if (rotation_mode != crtc->rotation_mode ||
+        scaling_mode != crtc->scaling_mode) {
+      if (!cursor_state->cached)
+        egl_release_fb(ctx->fd, crtc->egl_ctx, cursor_state->fb);
+
+      crtc->rotation_mode = rotation_mode;
+      crtc->scaling_mode = scaling_mode;
+      if (drm_crtc_get_fb(ctx, crtc, cursor_state, 0) < 0)
+        return -1;
+    }
+
+    if (!drm_crtc_test_plane(ctx, crtc, cursor_state))
+      goto out;
+  }
+
+  return 1;
+out:
+  if (rotating || scaling)
+    DRM_INFO("CRTC[%d]: rotating by %s, scaling by %s\n", crtc->crtc_id,
+             crtc->rotation_mode == TRANSFORM_GL ? "GL" : "plane",
+             crtc->scaling_mode == TRANSFORM_GL ? "GL" : "plane");
+  return 0;
+}
+
+/* Validate the format and transforms with the plane on the first cursor */
+static int drm_crtc_check_plane(drm_ctx *ctx, drm_crtc *crtc,
+                                drm_cursor_state *cursor_state)
+{
+  drm_plane_format *format;
+  int ret;
+
+  if (crtc->rotation_mode != TRANSFORM_UNKNOWN)
+    return 0;
+
+  while ((ret = drm_crtc_probe_transforms(ctx, crtc, cursor_state)) > 0) {
+    format = &crtc->plane->formats[crtc->format_idx];
+    DRM_INFO("CRTC[%d]: format: %.4s:%#"PRIx64" rejected by plane: %d\n",
+             crtc->crtc_id, (char *)&format->format, format->modifier,
+             crtc->plane->plane_id);
+
+    if (!cursor_state->cached)
+      egl_release_fb(ctx->fd, crtc->egl_ctx, cursor_state->fb);
+
+    /* Fallback to the next format */
+    drm_crtc_free_frames(ctx, crtc);
+    egl_free_ctx(crtc->egl_ctx);
+    crtc->egl_ctx = NULL;
+    crtc->format_idx++;
+
+    crtc->rotation_mode = crtc->scaling_mode = TRANSFORM_UNKNOWN;
+    if (drm_crtc_get_fb(ctx, crtc, cursor_state, 0) < 0)
+      return -1;
+  }
+
+  return ret;
+}
+
+/* Convert and pin all frames of the animation */
+static int drm_crtc_prepare_animation(drm_ctx *ctx, drm_crtc *crtc,
+                                      drm_cursor_state *cursor_state)
+{
+  drm_cursor_state frame_state;
+  int i;
+
+  for (i = 0; i < cursor_state->anim_count; i++) {
+    frame_state = *cursor_state;
+    frame_state.handle = cursor_state->anim_handles[i];
+    frame_state.off_x = frame_state.off_y = 0;
 
-  if (ctx->scale_from) {
-    scale_x = scale_y =
-      ctx->scale_from * crtc->width * crtc->height / width / height;
-  } else {
-    scale_x = ctx->scale_x ? ctx->scale_x : 1.0;
-    scale_y = ctx->scale_y ? ctx->scale_y : 1.0;
+    if (drm_crtc_get_cached_fb(ctx, crtc, &frame_state, 1) < 0) {
+      DRM_ERROR("CRTC[%d]: failed to prepare animation\n", crtc->crtc_id);
+      drm_crtc_unpin_frames(crtc);
+      return -1;
+    }
   }
 
-  width *= scale_x;
-  height *= scale_y;
+  DRM_DEBUG("CRTC[%d]: play animation of %d frames every %dms\n",
+            crtc->crtc_id, cursor_state->anim_count,
+            cursor_state->anim_interval);
 
-  x = cursor_state->x + cursor_state->hot_x - cursor_state->hot_x * scale_x;
-  y = cursor_state->y + cursor_state->hot_y - cursor_state->hot_y * scale_y;
-  area_w = crtc->width - width;
-  area_h = crtc->height - height;
+  crtc->anim_frame = 0;
+  crtc->anim_next_time =
+    drm_curr_time_us() + cursor_state->anim_interval * 1000ULL;
+  return 0;
+}
 
-  off_x = off_y = 0;
+#define drm_crtc_animating(crtc) \
+  ((crtc)->cursor_curr.anim_count > 1 && (crtc)->cursor_curr.fb)
 
-  if (x < 0)
-    off_x = x;
+/* Timeout (ms) until the next animation frame */
+static int drm_crtc_anim_timeout(drm_crtc *crtc)
+{
+  uint64_t now = drm_curr_time_us();
 
-  if (y < 0)
-    off_y = y;
+  if (crtc->anim_next_time <= now + 1000)
+    return 1;
 
-  if (x > area_w)
-    off_x = x - area_w;
+  return (crtc->anim_next_time - now) / 1000;
+}
 
-  if (y > area_h)
-    off_y = y - area_h;
+/* Flip to the next animation frame, only converting for edge moving */
+static int drm_crtc_play_animation(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_cursor_state cursor_state = crtc->cursor_curr;
+  uint64_t now = drm_curr_time_us();
 
-  cursor_state->scaled_x = x;
-  cursor_state->scaled_y = y;
-  cursor_state->off_x = off_x;
-  cursor_state->off_y = off_y;
-  cursor_state->scaled_w = width;
-  cursor_state->scaled_h = height;
+  if (now + 1000 < crtc->anim_next_time)
+    return 0;
+
+  crtc->anim_frame = (crtc->anim_frame + 1) % cursor_state.anim_count;
+  crtc->anim_next_time += cursor_state.anim_interval * 1000ULL;
+  if (crtc->anim_next_time < now)
+    crtc->anim_next_time = now + cursor_state.anim_interval * 1000ULL;
+
+  cursor_state.handle = cursor_state.anim_handles[crtc->anim_frame];
+  if (drm_crtc_get_fb(ctx, crtc, &cursor_state, 1) < 0 ||
+      drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
+    DRM_ERROR("CRTC[%d]: failed to play animation\n", crtc->crtc_id);
+    crtc->cursor_curr.anim_count = 0;
+    drm_crtc_unpin_frames(crtc);
+    return -1;
+  }
 
+  crtc->stats.anim_frames++;
+  drm_crtc_update_presented(ctx, crtc, 0);
   return 0;
 }
 
-#define drm_crtc_disable_cursor(ctx, crtc) \
-  drm_crtc_update_cursor(ctx, crtc, NULL)
-
-static int drm_crtc_update_cursor(drm_ctx *ctx, drm_crtc *crtc,
-                                  drm_cursor_state *cursor_state)
+/* Release conversion resources, the current FB stays on screen */
+static void drm_crtc_trim(drm_ctx *ctx, drm_crtc *crtc)
 {
-  drm_plane *plane = crtc->plane;
-  uint32_t old_fb = crtc->cursor_curr.fb;
-  uint32_t fb;
-  int x, y, w, h, ret;
+  if (!crtc->egl_ctx)
+    return;
 
-  /* Disable */
-  if (!cursor_state) {
-    if (old_fb) {
-      DRM_DEBUG("CRTC[%d]: disabling cursor\n", crtc->crtc_id);
-      drm_set_plane(ctx, crtc, plane, 0, 0, 0, 0, 0);
-      drmModeRmFB(ctx->fd, old_fb);
-    }
+  DRM_DEBUG("CRTC[%d]: idle for %dms, releasing %"PRIu64" bytes\n",
+            crtc->crtc_id, ctx->idle_timeout, crtc->stats.mem_bytes);
 
-    memset(&crtc->cursor_curr, 0, sizeof(drm_cursor_state));
-    return 0;
-  }
+  drm_crtc_free_frames(ctx, crtc);
 
-  /* Unchanged */
-  if (crtc->cursor_curr.fb == cursor_state->fb &&
-      crtc->cursor_curr.scaled_x == cursor_state->scaled_x &&
-      crtc->cursor_curr.scaled_y == cursor_state->scaled_y &&
-      crtc->cursor_curr.off_x == cursor_state->off_x &&
-      crtc->cursor_curr.off_y == cursor_state->off_y) {
-    crtc->cursor_curr = *cursor_state;
+  egl_free_ctx(crtc->egl_ctx);
+  crtc->egl_ctx = NULL;
+
+  crtc->trimmed = 1;
+  crtc->stats.trims++;
+  crtc->stats.mem_bytes = 0;
+  drm_dump_stats(1);
+}
+
+/* Wait for new request, returns non-zero when timed out */
+static int drm_crtc_wait(drm_crtc *crtc, int timeout_ms)
+{
+  struct timespec ts;
+
+  if (timeout_ms <= 0) {
+    pthread_cond_wait(&crtc->cond, &crtc->mutex);
     return 0;
   }
 
-  fb = cursor_state->fb;
-  x = cursor_state->scaled_x - cursor_state->off_x;
-  y = cursor_state->scaled_y - cursor_state->off_y;
-  w = cursor_state->scaled_w;
-  h = cursor_state->scaled_h;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
 
-  DRM_DEBUG("CRTC[%d]: setting fb: %d (%dx%d) on plane: %d at (%d,%d)\n",
-            crtc->crtc_id, fb, w, h, plane->plane_id, x, y);
+  return pthread_cond_timedwait(&crtc->cond, &crtc->mutex, &ts) == ETIMEDOUT;
+}
 
-  ret = drm_set_plane(ctx, crtc, plane, fb, x, y, w, h);
-  if (ret)
-    DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n", crtc->crtc_id, errno);
+static void drm_crtc_update_atomic_cap(drm_ctx *ctx, drm_crtc *crtc)
+{
+  int fd_gen = __atomic_load_n(&ctx->fd_gen, __ATOMIC_ACQUIRE);
 
-  if (old_fb && old_fb != fb) {
-    DRM_DEBUG("CRTC[%d]: remove FB: %d\n", crtc->crtc_id, old_fb);
-    drmModeRmFB(ctx->fd, old_fb);
-  }
+  if (crtc->fd_gen == fd_gen || crtc->plane->cursor_plane)
+    return;
 
-  crtc->cursor_curr = *cursor_state;
-  return ret;
+  /* The client caps are per-file, set it again after switching fd */
+  drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+  crtc->fd_gen = fd_gen;
 }
 
-static int drm_crtc_create_fb(drm_ctx *ctx, drm_crtc *crtc,
-                              drm_cursor_state *cursor_state)
+/* Release all resources of the plane, before unbinding it */
+static void drm_crtc_release(drm_ctx *ctx, drm_crtc *crtc)
 {
-  uint32_t handle = cursor_state->handle;
-  int width = cursor_state->width;
-  int height = cursor_state->height;
-  int scaled_w = cursor_state->scaled_w;
-  int scaled_h = cursor_state->scaled_h;
-  int off_x = cursor_state->off_x;
-  int off_y = cursor_state->off_y;
+  drm_crtc_free_frames(ctx, crtc);
 
-  DRM_DEBUG("CRTC[%d]: convert FB from %d (%dx%d) to (%dx%d) offset: (%d,%d)\n",
-            crtc->crtc_id, handle, width, height,
-            scaled_w, scaled_h, off_x, off_y);
+  pthread_mutex_lock(&ctx->frames_mutex);
+  free(crtc->frames);
+  crtc->frames = NULL;
+  pthread_mutex_unlock(&ctx->frames_mutex);
 
-  if (!crtc->egl_ctx) {
-    uint64_t modifier;
-    int format;
+  if (crtc->egl_ctx)
+    egl_free_ctx(crtc->egl_ctx);
+  crtc->egl_ctx = NULL;
+  crtc->stats.mem_bytes = 0;
 
-    if (crtc->use_afbc_modifier) {
-      /* Mali only support AFBC with BGR formats now */
-      format = GBM_FORMAT_ABGR8888;
-      modifier = DRM_AFBC_MODIFIER;
-    } else {
-      format = GBM_FORMAT_ARGB8888;
-      modifier = 0;
-    }
+  /* The next plane might not be able to rotate or scale */
+  crtc->rotation_mode = crtc->scaling_mode = TRANSFORM_UNKNOWN;
 
-    crtc->egl_ctx = egl_init_ctx(ctx->fd, ctx->num_surfaces, format, modifier);
-    if (!crtc->egl_ctx) {
-      DRM_ERROR("CRTC[%d]: failed to init egl ctx\n", crtc->crtc_id);
-      return -1;
-    }
-  }
+  drm_crtc_disable_cursor(ctx, crtc);
+}
 
-  cursor_state->fb =
-    egl_convert_fb(ctx->fd, crtc->egl_ctx, handle, width, height,
-                   scaled_w, scaled_h, off_x, off_y);
-  if (!cursor_state->fb) {
-    DRM_ERROR("CRTC[%d]: failed to create FB\n", crtc->crtc_id);
-    return -1;
-  }
+static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc);
 
-  DRM_DEBUG("CRTC[%d]: created FB: %d\n", crtc->crtc_id, cursor_state->fb);
-  return 0;
+static void drm_crtc_setup_thread(drm_ctx *ctx, drm_crtc *crtc)
+{
+  struct sched_param param = { .sched_priority = ctx->sched_priority };
+  int ret;
+
+  if (ctx->sched_policy != SCHED_OTHER &&
+      (ret = pthread_setschedparam(pthread_self(), ctx->sched_policy, &param)))
+    DRM_ERROR("CRTC[%d]: failed to set scheduling (%d)\n",
+              crtc->crtc_id, ret);
+
+  if (CPU_COUNT(&ctx->cpu_affinity) &&
+      (ret = pthread_setaffinity_np(pthread_self(), sizeof(ctx->cpu_affinity),
+                                    &ctx->cpu_affinity)))
+    DRM_ERROR("CRTC[%d]: failed to set affinity (%d)\n", crtc->crtc_id, ret);
+
+  /* The prctl resets the slack of 0 to the default, use the minimum (1ns) */
+  if (ctx->timer_slack >= 0 &&
+      prctl(PR_SET_TIMERSLACK,
+            ctx->timer_slack ? ctx->timer_slack * 1000UL : 1UL) < 0)
+    DRM_ERROR("CRTC[%d]: failed to set timer slack (%d)\n",
+              crtc->crtc_id, errno);
+
+  if (g_drm_mlock == 1 && drm_lock_stack() < 0)
+    DRM_ERROR("CRTC[%d]: failed to lock stack (%d)\n", crtc->crtc_id, errno);
 }
 
 static void *drm_crtc_thread_fn(void *data)
 {
-  drm_ctx *ctx = drm_get_ctx(-1);
   drm_crtc *crtc = data;
+  drm_ctx *ctx = crtc->ctx;
   drm_plane *plane = crtc->plane;
   drm_cursor_state cursor_state;
-  uint64_t duration;
+  uint64_t duration, commit_start;
   char name[256];
+  int rebind = 0, scheduled;
 
   DRM_DEBUG("CRTC[%d]: thread started\n", crtc->crtc_id);
 
@@ -948,16 +3801,24 @@ static void *drm_crtc_thread_fn(void *data)
    * The new DRM driver doesn't allow setting atomic cap for Xorg.
    * Let's use a custom thread name to workaround that.
    */
-  snprintf(name, sizeof(name), "drm-cursor[%d]", crtc->crtc_id);
+  if (crtc->pointer)
+    snprintf(name, sizeof(name), "drm-cursor[%d.%d]",
+             crtc->crtc_id, crtc->pointer);
+  else
+    snprintf(name, sizeof(name), "drm-cursor[%d]", crtc->crtc_id);
   pthread_setname_np(crtc->thread, name);
 
+  drm_crtc_setup_thread(ctx, crtc);
+
   if (!plane->cursor_plane) {
+    crtc->fd_gen = __atomic_load_n(&ctx->fd_gen, __ATOMIC_ACQUIRE);
     drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_ATOMIC, 1);
 
     /* Reflush props with atomic cap enabled */
     drmModeFreeObjectProperties(plane->props);
     plane->props = drmModeObjectGetProperties(ctx->fd, plane->plane_id,
                                               DRM_MODE_OBJECT_PLANE);
+    memset(plane->prop_ids, 0, sizeof(plane->prop_ids));
     if (!plane->props)
       goto error;
 
@@ -975,10 +3836,34 @@ static void *drm_crtc_thread_fn(void *data)
   crtc->last_update_time = drm_curr_time();
 
   while (1) {
+    /* Whether the commit got scheduled to a vblank by late latching */
+    scheduled = 0;
+
     /* Wait for new cursor state */
     pthread_mutex_lock(&crtc->mutex);
-    while (crtc->state != PENDING)
-      pthread_cond_wait(&crtc->cond, &crtc->mutex);
+    crtc->waiting = 1;
+    while (crtc->state != PENDING) {
+      int animating = drm_crtc_animating(crtc);
+      int timeout = crtc->egl_ctx ? ctx->idle_timeout : 0;
+
+      if (animating)
+        timeout = drm_crtc_anim_timeout(crtc);
+
+      if (drm_crtc_wait(crtc, timeout) && crtc->state != PENDING) {
+        pthread_mutex_unlock(&crtc->mutex);
+        if (animating)
+          drm_crtc_play_animation(ctx, crtc);
+        else
+          drm_crtc_trim(ctx, crtc);
+        pthread_mutex_lock(&crtc->mutex);
+      }
+    }
+
+    crtc->waiting = 0;
+    if (crtc->post_time) {
+      drm_crtc_update_wake(crtc, crtc->post_time);
+      crtc->post_time = 0;
+    }
 
     cursor_state = crtc->cursor_next;
     crtc->cursor_next.request = 0;
@@ -986,9 +3871,21 @@ static void *drm_crtc_thread_fn(void *data)
     cursor_state.request |= crtc->cursor_curr.request; /* For retry */
     pthread_mutex_unlock(&crtc->mutex);
 
+    /* Move to another plane */
+    if (__atomic_load_n(&crtc->reselect, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&plane->yielded, __ATOMIC_ACQUIRE))
+      goto reselect;
+
+    drm_crtc_update_atomic_cap(ctx, crtc);
+
     /* For edge moving */
     if (drm_crtc_update_offsets(ctx, crtc, &cursor_state) < 0) {
       DRM_DEBUG("CRTC[%d]: unavailable!\n", crtc->crtc_id);
+
+      /* Let other CRTCs use the plane, and re-select when back */
+      if (crtc->unplugged)
+        goto release;
+
       drm_crtc_disable_cursor(ctx, crtc);
       goto retry;
     }
@@ -1001,18 +3898,35 @@ static void *drm_crtc_thread_fn(void *data)
                 crtc->crtc_id, cursor_state.handle,
                 cursor_state.width, cursor_state.height);
 
+      /* Extra pointers give their planes back when hidden */
+      if (!cursor_state.handle && crtc->pointer)
+        goto hide;
+
       if (!cursor_state.handle) {
         drm_crtc_disable_cursor(ctx, crtc);
+        drm_crtc_update_presented(ctx, crtc, 0);
         goto next;
       }
 
-      if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
+      /* Frames of the previous animation are not needed anymore */
+      drm_crtc_unpin_frames(crtc);
+
+      if (drm_crtc_get_fb(ctx, crtc, &cursor_state, 0) < 0)
+        goto error;
+
+      if (drm_crtc_check_plane(ctx, crtc, &cursor_state) < 0)
         goto error;
 
+      if (cursor_state.anim_count > 1 &&
+          drm_crtc_prepare_animation(ctx, crtc, &cursor_state) < 0)
+        cursor_state.anim_count = 0;
+
       if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
         DRM_ERROR("CRTC[%d]: failed to set cursor\n", crtc->crtc_id);
         goto error;
       }
+
+      drm_crtc_update_presented(ctx, crtc, 0);
     } else if (cursor_state.request & REQ_MOVE_CURSOR) {
       cursor_state.request = 0;
 
@@ -1025,20 +3939,49 @@ static void *drm_crtc_thread_fn(void *data)
         /* Pre-moving */
         crtc->cursor_curr = cursor_state;
         goto next;
-      } else if (crtc->cursor_curr.off_x != cursor_state.off_x ||
-                 crtc->cursor_curr.off_y != cursor_state.off_y) {
-        /* Edge moving */
-        if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
+      }
+
+      /* Keep the current animation frame */
+      cursor_state.handle = crtc->cursor_curr.handle;
+
+      if (crtc->degraded)
+        drm_crtc_decay_budget(ctx, crtc);
+
+      if (crtc->degraded &&
+          (crtc->cursor_curr.off_x != cursor_state.off_x ||
+           crtc->cursor_curr.off_y != cursor_state.off_y))
+        drm_crtc_degrade_offsets(ctx, crtc, &cursor_state);
+
+      if (crtc->cursor_curr.off_x != cursor_state.off_x ||
+          crtc->cursor_curr.off_y != cursor_state.off_y) {
+        /* Edge moving, back from the edge by the cached FB when degraded */
+        if (crtc->degraded && !cursor_state.off_x && !cursor_state.off_y) {
+          if (drm_crtc_get_fb(ctx, crtc, &cursor_state, 0) < 0)
+            goto error;
+        } else if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0) {
           goto error;
+        }
       } else {
         /* Normal moving */
         cursor_state.fb = crtc->cursor_curr.fb;
+        cursor_state.format = crtc->cursor_curr.format;
+        cursor_state.modifier = crtc->cursor_curr.modifier;
+        cursor_state.cached = crtc->cursor_curr.cached;
+
+        if (ctx->late_latch)
+          scheduled = !drm_crtc_late_latch(ctx, crtc, &cursor_state);
       }
 
+      commit_start = drm_curr_time_us();
       if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
         DRM_ERROR("CRTC[%d]: failed to move cursor\n", crtc->crtc_id);
         goto error;
       }
+
+      if (scheduled)
+        drm_crtc_update_sched(ctx, crtc, commit_start);
+
+      drm_crtc_update_presented(ctx, crtc, scheduled);
     }
 
     if (!crtc->verified && crtc->cursor_curr.fb) {
@@ -1050,10 +3993,15 @@ static void *drm_crtc_thread_fn(void *data)
     }
 
 next:
+    /* Moving should not stall the animation */
+    if (drm_crtc_animating(crtc))
+      drm_crtc_play_animation(ctx, crtc);
+
+    /* Paced by the vblank when scheduled by late latching */
     duration = drm_curr_time() - crtc->last_update_time;
-    if (duration < ctx->min_interval)
+    if (!scheduled && duration < ctx->min_interval)
       usleep((ctx->min_interval - duration) * 1000);
-    crtc->last_update_time = drm_curr_time();;
+    crtc->last_update_time = drm_curr_time();
     continue;
 retry:
     /* Force setting cursor in next request */
@@ -1064,30 +4012,62 @@ retry:
     goto next;
   }
 
-error:
-  if (crtc->egl_ctx)
-    egl_free_ctx(crtc->egl_ctx);
+reselect:
+  rebind = 1;
+release:
+  drm_crtc_release(ctx, crtc);
 
-  drm_crtc_disable_cursor(ctx, crtc);
+  pthread_mutex_lock(&crtc->mutex);
+  DRM_INFO("CRTC[%d]: release plane: %d\n", crtc->crtc_id, plane->plane_id);
+  crtc->unplugged = 0;
+
+  /* Restore the cursor after re-selecting, and fake the retry as succeeded */
+  crtc->cursor_next.request |= REQ_SET_CURSOR;
+  crtc->cursor_curr.request = REQ_SET_CURSOR;
+  crtc->state = PENDING;
+  goto unbind;
+hide:
+  drm_crtc_release(ctx, crtc);
+  drm_crtc_update_presented(ctx, crtc, 0);
+
+  pthread_mutex_lock(&crtc->mutex);
+  DRM_INFO("CRTC[%d]: pointer: %d hidden, release plane: %d\n",
+           crtc->crtc_id, crtc->pointer, plane->plane_id);
+
+  /* Shown again meanwhile */
+  rebind = crtc->state == PENDING &&
+    crtc->cursor_next.request & REQ_SET_CURSOR && crtc->cursor_next.handle;
+  goto unbind;
+error:
+  drm_crtc_release(ctx, crtc);
 
   pthread_mutex_lock(&crtc->mutex);
   DRM_DEBUG("CRTC[%d]: thread error\n", crtc->crtc_id);
   crtc->state = FATAL_ERROR;
-
-  if (crtc->plane) {
-    drm_free_plane(crtc->plane);
-    crtc->plane = NULL;
-  }
+unbind:
+  pthread_mutex_lock(&ctx->mutex);
+  __atomic_store_n(&crtc->plane, NULL, __ATOMIC_RELEASE);
+  plane->crtc_id = 0;
+  pthread_mutex_unlock(&ctx->mutex);
 
   pthread_cond_signal(&crtc->cond);
   pthread_mutex_unlock(&crtc->mutex);
 
+  /* Reply the pending yields */
+  if (__atomic_load_n(&plane->yielded, __ATOMIC_ACQUIRE))
+    drm_control_notify();
+
+  /* Restore the cursor on the next best plane right away */
+  if (rebind)
+    drm_crtc_prepare(ctx, crtc);
+
   return NULL;
 }
 
-static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
+static int drm_crtc_prepare_locked(drm_ctx *ctx, drm_crtc *crtc)
 {
-  uint32_t i;
+  pthread_attr_t attr;
+  drm_plane *plane;
 
   /* Update CRTC if unavailable */
   if (drm_crtc_valid(crtc) < 0)
@@ -1099,28 +4079,175 @@ static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
 
   /* Try specific plane */
   if (crtc->prefer_plane_id)
-    drm_crtc_bind_plane_force(ctx, crtc, crtc->prefer_plane_id);
+    drm_crtc_bind_plane(ctx, crtc, crtc->prefer_plane_id);
 
-  /* Try cursor plane */
-  for (i = 0; !crtc->plane && i < ctx->pres->count_planes; i++)
-    drm_crtc_bind_plane_cursor(ctx, crtc, ctx->pres->planes[i]);
-
-  /* Fallback to any available overlay plane */
-  if (ctx->allow_overlay) {
-    for (i = ctx->pres->count_planes; !crtc->plane && i; i--)
-      drm_crtc_bind_plane_force(ctx, crtc, ctx->pres->planes[i - 1]);
-  }
+  /* Select the fastest available plane */
+  if (!crtc->plane && (plane = drm_crtc_select_plane(ctx, crtc)))
+    drm_crtc_bind_plane(ctx, crtc, plane->plane_id);
 
   if (!crtc->plane) {
     DRM_ERROR("CRTC[%d]: failed to find any plane\n", crtc->crtc_id);
     return -1;
   }
 
-  crtc->state = IDLE;
+  /* Keep the pending requests of a released plane */
+  pthread_mutex_lock(&crtc->mutex);
+  if (crtc->state == FATAL_ERROR)
+    crtc->state = IDLE;
+  pthread_mutex_unlock(&crtc->mutex);
 
-  pthread_cond_init(&crtc->cond, NULL);
-  pthread_mutex_init(&crtc->mutex, NULL);
-  pthread_create(&crtc->thread, NULL, drm_crtc_thread_fn, crtc);
+  /* A smaller stack than the default, to lock as a whole */
+  pthread_attr_init(&attr);
+  if (g_drm_mlock == 1)
+    pthread_attr_setstacksize(&attr, DRM_THREAD_STACK_SIZE);
+
+  pthread_create(&crtc->thread, &attr, drm_crtc_thread_fn, crtc);
+  pthread_detach(crtc->thread);
+  pthread_attr_destroy(&attr);
+
+  return 0;
+}
+
+static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
+{
+  int ret;
+
+  /* Fast path for the already assigned and valid CRTC */
+  if (__atomic_load_n(&crtc->plane, __ATOMIC_ACQUIRE) &&
+      !drm_crtc_valid(crtc))
+    return 1;
+
+  pthread_mutex_lock(&ctx->mutex);
+  ret = drm_crtc_prepare_locked(ctx, crtc);
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return ret;
+}
+
+/* Hidden extra pointers have no plane until set again */
+static int drm_crtc_hidden(drm_crtc *crtc)
+{
+  return crtc->pointer && !crtc->cursor_next.handle;
+}
+
+/* Wake the CRTC's thread to move to another plane */
+static void drm_crtc_request_reselect(drm_crtc *crtc)
+{
+  pthread_mutex_lock(&crtc->mutex);
+  crtc->cursor_next.request |= REQ_RESELECT;
+  crtc->state = PENDING;
+  pthread_cond_signal(&crtc->cond);
+  pthread_mutex_unlock(&crtc->mutex);
+}
+
+static int drm_ctx_plane_busy(drm_ctx *ctx, uint32_t plane_id)
+{
+  drm_plane *plane;
+  int busy;
+
+  pthread_mutex_lock(&ctx->mutex);
+  plane = drm_ctx_get_plane(ctx, plane_id);
+  busy = plane && plane->crtc_id;
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return busy;
+}
+
+/**
+ * Lend the plane to another client (e.g. a video player), moving the cursor
+ * to the next best plane, or take it back. Returns 1 when the cursor has
+ * yet to leave the yielded plane.
+ */
+static int drm_ctx_yield_plane(drm_ctx *ctx, uint32_t plane_id, int yield)
+{
+  drm_plane *plane, *best;
+  drm_crtc *crtc;
+  int i, num_crtcs;
+
+  pthread_mutex_lock(&ctx->mutex);
+
+  plane = drm_ctx_get_plane(ctx, plane_id);
+  if (!plane) {
+    pthread_mutex_unlock(&ctx->mutex);
+    return -1;
+  }
+
+  DRM_INFO("%s plane: %d\n", yield ? "yield" : "reclaim", plane_id);
+  __atomic_store_n(&plane->yielded, yield, __ATOMIC_RELEASE);
+
+  num_crtcs = __atomic_load_n(&ctx->num_crtcs, __ATOMIC_ACQUIRE);
+  for (i = 0; i < num_crtcs; i++) {
+    crtc = &ctx->crtcs[i];
+    if (crtc->blocked || !crtc->plane)
+      continue;
+
+    if (yield) {
+      if (crtc->plane == plane)
+        __atomic_store_n(&crtc->reselect, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    /* Take the plane back when it's better */
+    best = drm_crtc_select_plane(ctx, crtc);
+    if (best == plane &&
+        (plane_id == crtc->prefer_plane_id ||
+         drm_crtc_score_plane(ctx, crtc, plane, ctx->allow_overlay) >
+         crtc->stats.plane_score))
+      __atomic_store_n(&crtc->reselect, 1, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&ctx->mutex);
+
+  for (i = 0; i < num_crtcs; i++) {
+    crtc = &ctx->crtcs[i];
+    if (crtc->blocked || drm_crtc_hidden(crtc))
+      continue;
+
+    if (__atomic_load_n(&crtc->reselect, __ATOMIC_ACQUIRE)) {
+      drm_crtc_request_reselect(crtc);
+      continue;
+    }
+
+    /* Retry the CRTCs that failed to find any plane */
+    if (!yield && !__atomic_load_n(&crtc->plane, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&crtc->state, __ATOMIC_ACQUIRE) == PENDING)
+      drm_crtc_prepare(ctx, crtc);
+  }
+
+  return yield && drm_ctx_plane_busy(ctx, plane_id);
+}
+
+/**
+ * Yield (or reclaim) the plane on all devices having it, returns 1 when
+ * a cursor is still leaving it.
+ */
+static int drm_yield_plane(uint32_t plane_id, int yield)
+{
+  drm_ctx *ctx;
+  int r, ret = -1;
+
+  for (ctx = __atomic_load_n(&g_drm_ctxs, __ATOMIC_ACQUIRE);
+       ctx; ctx = ctx->next) {
+    if (!ctx->inited)
+      continue;
+
+    r = drm_ctx_yield_plane(ctx, plane_id, yield);
+    if (r >= 0 && r > ret)
+      ret = r;
+  }
+
+  return ret;
+}
+
+static int drm_plane_busy(uint32_t plane_id)
+{
+  drm_ctx *ctx;
+
+  for (ctx = __atomic_load_n(&g_drm_ctxs, __ATOMIC_ACQUIRE);
+       ctx; ctx = ctx->next) {
+    if (ctx->inited && drm_ctx_plane_busy(ctx, plane_id))
+      return 1;
+  }
 
   return 0;
 }
@@ -1128,52 +4255,127 @@ static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
 static drm_crtc *drm_get_crtc(drm_ctx *ctx, uint32_t crtc_id)
 {
   drm_crtc *crtc = NULL;
-  int i;
+  int i, num_crtcs;
 
-  for (i = 0; i < ctx->num_crtcs; i++) {
+  num_crtcs = __atomic_load_n(&ctx->num_crtcs, __ATOMIC_ACQUIRE);
+  for (i = 0; i < num_crtcs; i++) {
     crtc = &ctx->crtcs[i];
+    if (crtc->pointer)
+      continue;
+
     if (!crtc_id && drm_update_crtc(ctx, crtc) < 0)
       continue;
 
-    if (crtc->blocked)
-      continue;
+    if (crtc->blocked)
+      continue;
+
+    if (!crtc_id || crtc->crtc_id == crtc_id)
+      break;
+  }
+
+  if (i == num_crtcs) {
+    DRM_ERROR("CRTC[%d]: not available\n", crtc_id);
+    return NULL;
+  }
+
+  return crtc;
+}
+
+/**
+ * Find the CRTC's extra pointer, or add it when create is set.
+ * Pointer 0 is the CRTC itself.
+ */
+static drm_crtc *drm_get_pointer(drm_ctx *ctx, uint32_t crtc_id, int pointer,
+                                 int create)
+{
+  drm_crtc *main_crtc, *crtc;
+
+  main_crtc = drm_get_crtc(ctx, crtc_id);
+  if (!main_crtc || !pointer)
+    return main_crtc;
 
-    if (!crtc_id || crtc->crtc_id == crtc_id)
-      break;
+  if (pointer < 0 || pointer >= ctx->max_pointers) {
+    DRM_ERROR("CRTC[%d]: invalid pointer: %d\n", crtc_id, pointer);
+    return NULL;
   }
 
-  if (i == ctx->num_crtcs) {
-    DRM_ERROR("CRTC[%d]: not available\n", crtc_id);
-    return NULL;
+  pthread_mutex_lock(&ctx->mutex);
+  for (int i = 0; i < ctx->num_crtcs; i++) {
+    crtc = &ctx->crtcs[i];
+    if (crtc->crtc_id == main_crtc->crtc_id && crtc->pointer == pointer)
+      goto out;
   }
 
+  crtc = NULL;
+  if (!create || ctx->num_crtcs == ctx->max_crtcs)
+    goto out;
+
+  /* Publish it after initialized, for the lockless readers */
+  crtc = &ctx->crtcs[ctx->num_crtcs];
+  crtc->ctx = ctx;
+  crtc->crtc_id = main_crtc->crtc_id;
+  crtc->crtc_pipe = main_crtc->crtc_pipe;
+  crtc->blocked = main_crtc->blocked;
+  crtc->prefer_plane_id = main_crtc->prefer_plane_id;
+  crtc->pointer = pointer;
+  drm_crtc_init_locks(crtc);
+
+  DRM_DEBUG("CRTC[%d]: add pointer: %d\n", crtc->crtc_id, pointer);
+  __atomic_store_n(&ctx->num_crtcs, ctx->num_crtcs + 1, __ATOMIC_RELEASE);
+out:
+  pthread_mutex_unlock(&ctx->mutex);
+
+  if (!crtc)
+    DRM_ERROR("CRTC[%d]: pointer: %d not available\n", crtc_id, pointer);
+
   return crtc;
 }
 
-static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
-                          uint32_t width, uint32_t height,
-                          int hot_x, int hot_y)
+static int drm_set_cursor_anim(int fd, uint32_t crtc_id, int pointer,
+                               const uint32_t *handles, int count,
+                               uint32_t width, uint32_t height,
+                               int hot_x, int hot_y, uint32_t interval)
 {
+  uint32_t handle = count > 0 ? handles[0] : 0;
   drm_crtc *crtc;
   drm_ctx *ctx;
   drm_cursor_state *cursor_next;
+  void *client;
+  int ret;
 
-  ctx = drm_get_ctx(fd);
+  /* The handle must be valid for our fd */
+  ctx = drm_get_ctx_verified(fd);
   if (!ctx)
     return -1;
 
+  client = drm_ctx_client(ctx);
+
+  /* The daemon protocol has no pointers */
+  if (client && pointer)
+    return -1;
+
+  if (client) {
+    ret = drm_client_set(client, crtc_id, handles, count,
+                         width, height, hot_x, hot_y, interval);
+    if (ret >= 0 || drm_ctx_drop_client(ctx) < 0)
+      return ret;
+  }
+
   if (ctx->hide)
     return 0;
 
-  crtc = drm_get_crtc(ctx, crtc_id);
+  crtc = drm_get_pointer(ctx, crtc_id, pointer, 1);
   if (!crtc)
     return -1;
 
-  if (drm_crtc_prepare(ctx, crtc) < 0)
-    return -1;
+  /* Hiding an extra pointer releases its plane in the thread */
+  if (handle || !pointer || __atomic_load_n(&crtc->plane, __ATOMIC_ACQUIRE)) {
+    if (drm_crtc_prepare(ctx, crtc) < 0)
+      return -1;
+  }
 
-  DRM_DEBUG("CRTC[%d]: request setting new cursor %d (%dx%d)\n",
-            crtc->crtc_id, handle, width, height);
+  DRM_DEBUG("CRTC[%d]: request setting new cursor %d (%dx%d) pointer: %d\n",
+            crtc->crtc_id, handle, width, height, pointer);
 
   pthread_mutex_lock(&crtc->mutex);
   if (crtc->state == FATAL_ERROR) {
@@ -1194,6 +4396,12 @@ static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
   cursor_next->height = height;
   cursor_next->hot_x = hot_x;
   cursor_next->hot_y = hot_y;
+
+  cursor_next->anim_count = handle && count > 1 ? count : 0;
+  cursor_next->anim_interval = interval;
+  if (cursor_next->anim_count)
+    memcpy(cursor_next->anim_handles, handles, count * sizeof(*handles));
+
   crtc->state = PENDING;
   pthread_cond_signal(&crtc->cond);
 
@@ -1217,50 +4425,331 @@ static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
   return 0;
 }
 
-static int drm_move_cursor(int fd, uint32_t crtc_id, int x, int y)
+/* Find and prepare the CRTC for moving */
+static drm_crtc *drm_get_crtc_for_move(drm_ctx *ctx, uint32_t crtc_id,
+                                       int pointer)
+{
+  drm_crtc *crtc;
+
+  crtc = drm_get_pointer(ctx, crtc_id, pointer, 1);
+  if (!crtc || crtc->state == FATAL_ERROR)
+    return NULL;
+
+  /* Hidden extra pointers only keep the position, for the next set */
+  if (crtc->pointer && !__atomic_load_n(&crtc->plane, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&ctx->mutex);
+    if (drm_crtc_valid(crtc) < 0)
+      drm_update_crtc(ctx, crtc);
+    pthread_mutex_unlock(&ctx->mutex);
+  } else if (drm_crtc_prepare(ctx, crtc) < 0) {
+    return NULL;
+  }
+
+  if (drm_crtc_valid(crtc) < 0)
+    return NULL;
+
+  return crtc;
+}
+
+/* Update next cursor state and notify the thread, with the mutex held */
+static int drm_crtc_post_move(drm_crtc *crtc, int x, int y, uint64_t timestamp)
+{
+  drm_cursor_state *cursor_next = &crtc->cursor_next;
+
+  if (crtc->state == FATAL_ERROR)
+    return -1;
+
+  cursor_next->request |= REQ_MOVE_CURSOR;
+  cursor_next->fb = 0;
+  cursor_next->x = x;
+  cursor_next->y = y;
+  cursor_next->timestamp = timestamp;
+
+  /* Waking the thread up */
+  if (crtc->waiting && crtc->state != PENDING)
+    crtc->post_time = drm_curr_time_us();
+
+  crtc->state = PENDING;
+  pthread_cond_signal(&crtc->cond);
+  return 0;
+}
+
+/**
+ * The server's positions lag behind the direct input, they are only applied
+ * after the input settled, which covers the warps as well.
+ */
+static int drm_crtc_post_server_move(drm_crtc *crtc, int x, int y,
+                                     uint64_t timestamp)
+{
+  if (!g_drm_input)
+    return drm_crtc_post_move(crtc, x, y, timestamp);
+
+  crtc->server_x = x;
+  crtc->server_y = y;
+  crtc->has_server_pos = 1;
+
+  if (drm_curr_time_us() - crtc->input_time < DRM_INPUT_SETTLE_MS * 1000)
+    return 0;
+
+  return drm_crtc_post_move(crtc, x, y, timestamp);
+}
+
+/* Post a position of the direct input, with the mutex held */
+static void drm_crtc_post_input(drm_crtc *crtc, int x, int y, uint64_t time)
+{
+  int width, height;
+
+  drm_crtc_get_size(crtc->ctx, crtc, &width, &height);
+  if (width <= 0 || height <= 0)
+    return;
+
+  /* Keep the hotspot on the CRTC */
+  x = CLAMP(x, -crtc->cursor_next.hot_x, width - 1 - crtc->cursor_next.hot_x);
+  y = CLAMP(y, -crtc->cursor_next.hot_y, height - 1 - crtc->cursor_next.hot_y);
+
+  crtc->input_time = drm_curr_time_us();
+  drm_crtc_post_move(crtc, x, y, time);
+}
+
+static void drm_input_motion(int dx, int dy, uint64_t time)
+{
+  drm_crtc *crtc = __atomic_load_n(&g_drm_input_crtc, __ATOMIC_ACQUIRE);
+
+  if (!crtc)
+    return;
+
+  pthread_mutex_lock(&crtc->mutex);
+  drm_crtc_post_input(crtc, crtc->cursor_next.x + dx,
+                      crtc->cursor_next.y + dy, time);
+  pthread_mutex_unlock(&crtc->mutex);
+}
+
+static void drm_input_absolute(double fx, double fy, uint64_t time)
+{
+  drm_crtc *crtc = __atomic_load_n(&g_drm_input_crtc, __ATOMIC_ACQUIRE);
+  int width, height;
+
+  if (!crtc)
+    return;
+
+  pthread_mutex_lock(&crtc->mutex);
+  drm_crtc_get_size(crtc->ctx, crtc, &width, &height);
+  drm_crtc_post_input(crtc, fx * (width - 1) - crtc->cursor_next.hot_x,
+                      fy * (height - 1) - crtc->cursor_next.hot_y, time);
+  pthread_mutex_unlock(&crtc->mutex);
+}
+
+/* Apply the server's deferred position */
+static void drm_crtc_reconcile(drm_crtc *crtc)
+{
+  pthread_mutex_lock(&crtc->mutex);
+  if (crtc->has_server_pos &&
+      (crtc->cursor_next.x != crtc->server_x ||
+       crtc->cursor_next.y != crtc->server_y)) {
+    DRM_DEBUG("CRTC[%d]: reconcile (%d,%d) to (%d,%d)\n", crtc->crtc_id,
+              crtc->cursor_next.x, crtc->cursor_next.y,
+              crtc->server_x, crtc->server_y);
+    drm_crtc_post_move(crtc, crtc->server_x, crtc->server_y,
+                       drm_curr_time_us());
+  }
+  pthread_mutex_unlock(&crtc->mutex);
+}
+
+/* Reconcile all CRTCs, the input might have left some with deferred ones */
+static void drm_input_idle(void)
+{
+  drm_ctx *ctx;
+
+  for (ctx = __atomic_load_n(&g_drm_ctxs, __ATOMIC_ACQUIRE);
+       ctx; ctx = ctx->next) {
+    int num_crtcs = __atomic_load_n(&ctx->num_crtcs, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < num_crtcs; i++) {
+      if (!ctx->crtcs[i].pointer)
+        drm_crtc_reconcile(&ctx->crtcs[i]);
+    }
+  }
+}
+
+/* Let the direct input follow the CRTC, flushing the previous one */
+static void drm_input_follow(drm_crtc *crtc)
+{
+  drm_crtc *prev;
+
+  prev = __atomic_exchange_n(&g_drm_input_crtc, crtc, __ATOMIC_ACQ_REL);
+  if (prev && prev != crtc)
+    drm_crtc_reconcile(prev);
+}
+
+static int drm_start_input(void)
+{
+  static const drm_input_ops ops = {
+    .motion = drm_input_motion,
+    .absolute = drm_input_absolute,
+    .idle = drm_input_idle,
+  };
+  const char *config;
+  double speed, accel;
+  int ret = 0;
+
+  pthread_mutex_lock(&g_drm_mutex);
+  if (g_drm_input)
+    goto out;
+
+  config = drm_get_config(OPT_EVDEV_SPEED);
+  speed = config ? atof(config) : 1.0;
+
+  config = drm_get_config(OPT_EVDEV_ACCEL);
+  accel = config ? atof(config) : 0.0;
+
+  ret = drm_input_init(&ops, speed, accel, DRM_INPUT_SETTLE_MS);
+  if (!ret)
+    __atomic_store_n(&g_drm_input, 1, __ATOMIC_RELEASE);
+out:
+  pthread_mutex_unlock(&g_drm_mutex);
+  return ret;
+}
+
+static int drm_move_cursor(int fd, uint32_t crtc_id, int pointer,
+                           int x, int y, uint64_t timestamp)
 {
   drm_ctx *ctx;
   drm_crtc *crtc;
-  drm_cursor_state *cursor_next;
+  void *client;
+  int ret;
 
   ctx = drm_get_ctx(fd);
   if (!ctx)
     return -1;
 
+  client = drm_ctx_client(ctx);
+  if (client && pointer)
+    return -1;
+
+  if (client) {
+    drm_cursor_pos pos = { .crtc_id = crtc_id, .x = x, .y = y };
+
+    ret = drm_client_move(client, &pos, 1, timestamp);
+    if (ret >= 0 || drm_ctx_drop_client(ctx) < 0)
+      return ret;
+  }
+
   if (ctx->hide)
     return 0;
 
-  crtc = drm_get_crtc(ctx, crtc_id);
+  crtc = drm_get_crtc_for_move(ctx, crtc_id, pointer);
   if (!crtc)
     return -1;
 
-  if (crtc->state == FATAL_ERROR || drm_crtc_prepare(ctx, crtc) < 0)
-    return -1;
+  DRM_DEBUG("CRTC[%d]: request moving cursor to (%d,%d) in (%dx%d)"
+            " pointer: %d\n", crtc->crtc_id, x, y, crtc->width, crtc->height,
+            pointer);
 
-  if (drm_crtc_valid(crtc) < 0)
+  pthread_mutex_lock(&crtc->mutex);
+  ret = drm_crtc_post_server_move(crtc, x, y, timestamp);
+  pthread_mutex_unlock(&crtc->mutex);
+
+  /* The direct input follows the server's CRTC */
+  if (g_drm_input && !pointer)
+    drm_input_follow(crtc);
+
+  return ret;
+}
+
+static int drm_crtc_cmp(const void *a, const void *b)
+{
+  const drm_crtc *crtc_a = *(drm_crtc * const *)a;
+  const drm_crtc *crtc_b = *(drm_crtc * const *)b;
+
+  return (crtc_a > crtc_b) - (crtc_a < crtc_b);
+}
+
+static int drm_move_cursor_batch(int fd, const drm_cursor_pos *positions,
+                                 int count, uint64_t timestamp)
+{
+  drm_crtc **crtcs, **targets;
+  drm_ctx *ctx;
+  void *client;
+  int i, ret = 0;
+
+  if (count <= 0)
+    return 0;
+
+  ctx = drm_get_ctx(fd);
+  if (!ctx)
     return -1;
 
-  DRM_DEBUG("CRTC[%d]: request moving cursor to (%d,%d) in (%dx%d)\n",
-            crtc->crtc_id, x, y, crtc->width, crtc->height);
+  client = drm_ctx_client(ctx);
+  if (client) {
+    if (drm_client_move(client, positions, count, timestamp) >= 0)
+      return 0;
 
-  pthread_mutex_lock(&crtc->mutex);
-  if (crtc->state == FATAL_ERROR) {
-    pthread_mutex_unlock(&crtc->mutex);
+    if (drm_ctx_drop_client(ctx) < 0)
+      return -1;
+  }
+
+  if (ctx->hide)
+    return 0;
+
+  crtcs = calloc(count * 2, sizeof(*crtcs));
+  if (!crtcs)
     return -1;
+
+  targets = crtcs + count;
+  for (i = 0; i < count; i++) {
+    targets[i] = drm_get_crtc_for_move(ctx, positions[i].crtc_id, 0);
+    if (!targets[i]) {
+      free(crtcs);
+      return -1;
+    }
   }
 
-  /* Update next cursor state and notify the thread */
-  cursor_next = &crtc->cursor_next;
+  /* Lock all CRTCs in address order to avoid deadlock */
+  memcpy(crtcs, targets, count * sizeof(*crtcs));
+  qsort(crtcs, count, sizeof(*crtcs), drm_crtc_cmp);
+  for (i = 0; i < count; i++) {
+    if (!i || crtcs[i] != crtcs[i - 1])
+      pthread_mutex_lock(&crtcs[i]->mutex);
+  }
 
-  cursor_next->request |= REQ_MOVE_CURSOR;
-  cursor_next->fb = 0;
-  cursor_next->x = x;
-  cursor_next->y = y;
-  crtc->state = PENDING;
-  pthread_cond_signal(&crtc->cond);
-  pthread_mutex_unlock(&crtc->mutex);
+  for (i = 0; i < count; i++) {
+    drm_crtc *crtc = targets[i];
 
-  return 0;
+    DRM_DEBUG("CRTC[%d]: request batch moving cursor to (%d,%d)\n",
+              crtc->crtc_id, positions[i].x, positions[i].y);
+
+    if (drm_crtc_post_server_move(crtc, positions[i].x, positions[i].y,
+                                  timestamp) < 0)
+      ret = -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (!i || crtcs[i] != crtcs[i - 1])
+      pthread_mutex_unlock(&crtcs[i]->mutex);
+  }
+
+  /* The direct input follows the server's CRTC that has the cursor */
+  for (i = 0; g_drm_input && i < count; i++) {
+    int width, height;
+
+    drm_crtc_get_size(ctx, targets[i], &width, &height);
+    if (positions[i].x >= 0 && positions[i].x < width &&
+        positions[i].y >= 0 && positions[i].y < height) {
+      drm_input_follow(targets[i]);
+      break;
+    }
+  }
+
+  free(crtcs);
+  return ret;
+}
+
+static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
+                          uint32_t width, uint32_t height,
+                          int hot_x, int hot_y)
+{
+  return drm_set_cursor_anim(fd, crtc_id, 0, &handle, 1,
+                             width, height, hot_x, hot_y, 0);
 }
 
 /* Hook functions */
@@ -1300,5 +4789,139 @@ int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle,
 int drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
 {
   DRM_DEBUG("fd: %d crtc: %d position: %d,%d\n", fd, crtcId, x, y);
-  return drm_move_cursor(fd, crtcId, x, y);
+  return drm_move_cursor(fd, crtcId, 0, x, y, 0);
+}
+
+/* Native APIs */
+
+uint64_t drm_cursor_get_time(void)
+{
+  return drm_curr_time_us();
+}
+
+int drm_cursor_set(int fd, uint32_t crtc_id, uint32_t handle,
+                   uint32_t width, uint32_t height, int hot_x, int hot_y)
+{
+  return drm_set_cursor(fd, crtc_id, handle, width, height, hot_x, hot_y);
+}
+
+int drm_cursor_set_animation(int fd, uint32_t crtc_id,
+                             const uint32_t *handles, int count,
+                             uint32_t width, uint32_t height,
+                             int hot_x, int hot_y, uint32_t interval_ms)
+{
+  if (!handles || count <= 0 || count > DRM_MAX_FRAMES || !interval_ms) {
+    DRM_ERROR("CRTC[%d]: invalid animation\n", crtc_id);
+    return -1;
+  }
+
+  return drm_set_cursor_anim(fd, crtc_id, 0, handles, count,
+                             width, height, hot_x, hot_y, interval_ms);
+}
+
+int drm_cursor_move(int fd, uint32_t crtc_id, int x, int y,
+                    uint64_t timestamp)
+{
+  if (!timestamp)
+    timestamp = drm_curr_time_us();
+
+  return drm_move_cursor(fd, crtc_id, 0, x, y, timestamp);
+}
+
+int drm_cursor_move_batch(int fd, const drm_cursor_pos *positions, int count,
+                          uint64_t timestamp)
+{
+  if (!timestamp)
+    timestamp = drm_curr_time_us();
+
+  return drm_move_cursor_batch(fd, positions, count, timestamp);
+}
+
+int drm_cursor_query(int fd, uint32_t crtc_id, drm_cursor_info *info)
+{
+  return drm_cursor_query_pointer(fd, crtc_id, 0, info);
+}
+
+int drm_cursor_set_pointer(int fd, uint32_t crtc_id, int pointer,
+                           uint32_t handle, uint32_t width, uint32_t height,
+                           int hot_x, int hot_y)
+{
+  return drm_set_cursor_anim(fd, crtc_id, pointer, &handle, 1,
+                             width, height, hot_x, hot_y, 0);
+}
+
+int drm_cursor_move_pointer(int fd, uint32_t crtc_id, int pointer,
+                            int x, int y, uint64_t timestamp)
+{
+  if (!timestamp)
+    timestamp = drm_curr_time_us();
+
+  return drm_move_cursor(fd, crtc_id, pointer, x, y, timestamp);
+}
+
+int drm_cursor_query_pointer(int fd, uint32_t crtc_id, int pointer,
+                             drm_cursor_info *info)
+{
+  drm_ctx *ctx;
+  drm_crtc *crtc;
+  void *client;
+  int ret;
+
+  ctx = drm_get_ctx(fd);
+  if (!ctx || !info)
+    return -1;
+
+  client = drm_ctx_client(ctx);
+  if (client && pointer)
+    return -1;
+
+  if (client) {
+    ret = drm_client_query(client, crtc_id, info);
+    if (ret >= 0 || drm_ctx_drop_client(ctx) < 0)
+      return ret;
+  }
+
+  crtc = drm_get_pointer(ctx, crtc_id, pointer, 0);
+  if (!crtc)
+    return -1;
+
+  /* Hidden extra pointers have no plane */
+  if (!crtc->plane && !crtc->pointer)
+    return -1;
+
+  pthread_mutex_lock(&crtc->mutex);
+  *info = crtc->presented;
+  pthread_mutex_unlock(&crtc->mutex);
+
+  return 0;
+}
+
+int drm_cursor_yield_plane(int fd, uint32_t plane_id)
+{
+  drm_ctx *ctx = drm_get_ctx(fd);
+  if (!ctx || drm_ctx_client(ctx))
+    return -1;
+
+  return drm_ctx_yield_plane(ctx, plane_id, 1);
+}
+
+int drm_cursor_reclaim_plane(int fd, uint32_t plane_id)
+{
+  drm_ctx *ctx = drm_get_ctx(fd);
+  if (!ctx || drm_ctx_client(ctx))
+    return -1;
+
+  return drm_ctx_yield_plane(ctx, plane_id, 0);
+}
+
+int drm_cursor_add_input(int fd)
+{
+  pthread_once(&g_drm_once, drm_init_once);
+
+  /* The server's moves go to the daemon */
+  if (fd < 0 || g_drm_daemon_socket || drm_start_input() < 0)
+    return -1;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return drm_input_add_fd(fd);
 }
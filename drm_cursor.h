@@ -0,0 +1,117 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_CURSOR_H_
+#define __DRM_CURSOR_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRM_CURSOR_API_VERSION 5
+
+/**
+ * Native cursor API, an alternative to the hooked libdrm cursor APIs.
+ *
+ * The fd is the caller's DRM fd, cursor handles are GEM handles of it.
+ * Times are in microseconds of CLOCK_MONOTONIC, 0 means unknown.
+ * All functions return 0 on success, or -1 on failure.
+ */
+
+typedef struct {
+  uint32_t crtc_id;
+  int x;
+  int y;
+} drm_cursor_pos;
+
+typedef struct {
+  int visible;
+
+  /* The position on screen, as passed by the caller */
+  int x;
+  int y;
+
+  /* The input timestamp of that position */
+  uint64_t timestamp;
+
+  /* The (estimated) time that it got presented */
+  uint64_t present_time;
+} drm_cursor_info;
+
+/* Current time in the clock domain of the APIs */
+uint64_t drm_cursor_get_time(void);
+
+int drm_cursor_set(int fd, uint32_t crtc_id, uint32_t handle,
+                   uint32_t width, uint32_t height, int hot_x, int hot_y);
+
+/**
+ * Set an animated cursor, played by the library every interval_ms.
+ * All frames are converted up front, at most 64 frames.
+ * Setting a new cursor stops the animation.
+ */
+int drm_cursor_set_animation(int fd, uint32_t crtc_id,
+                             const uint32_t *handles, int count,
+                             uint32_t width, uint32_t height,
+                             int hot_x, int hot_y, uint32_t interval_ms);
+
+int drm_cursor_move(int fd, uint32_t crtc_id, int x, int y,
+                    uint64_t timestamp);
+
+/* Post moves of multiple CRTCs, the workers would see all or none of them */
+int drm_cursor_move_batch(int fd, const drm_cursor_pos *positions, int count,
+                          uint64_t timestamp);
+
+int drm_cursor_query(int fd, uint32_t crtc_id, drm_cursor_info *info);
+
+/**
+ * Extra cursors of the CRTC (e.g. of multi-seat setups), each on a plane of
+ * its own. Pointer 0 is the cursor of the APIs above, others are added on
+ * the first use, up to max-pointers= of each CRTC. Hiding an extra pointer
+ * (handle 0) gives its plane back. Not available to daemon clients.
+ */
+int drm_cursor_set_pointer(int fd, uint32_t crtc_id, int pointer,
+                           uint32_t handle, uint32_t width, uint32_t height,
+                           int hot_x, int hot_y);
+
+int drm_cursor_move_pointer(int fd, uint32_t crtc_id, int pointer,
+                            int x, int y, uint64_t timestamp);
+
+int drm_cursor_query_pointer(int fd, uint32_t crtc_id, int pointer,
+                             drm_cursor_info *info);
+
+/**
+ * Lend the plane to the caller (e.g. for video overlays), the cursor moves to
+ * the next best plane, or hides when there's none, until it is reclaimed.
+ * Returns after the cursor has left the plane.
+ * Out-of-process clients can use the control socket (control-socket=).
+ */
+int drm_cursor_yield_plane(int fd, uint32_t plane_id);
+
+int drm_cursor_reclaim_plane(int fd, uint32_t plane_id);
+
+/**
+ * Move the cursor by pointer events (struct input_event) read from the fd,
+ * an evdev node or e.g. a pipe of synthetic events, without waiting for the
+ * server. The server's positions are applied once the input settled.
+ * The library takes the fd. Absolute events of non-evdev fds are in 0-32767.
+ */
+int drm_cursor_add_input(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
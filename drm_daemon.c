@@ -0,0 +1,555 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+
+#include <xf86drm.h>
+
+#include "drm_common.h"
+#include "drm_cursor.h"
+#include "drm_protocol.h"
+
+/**
+ * Cursor daemon, owning the planes, conversion and pacing for all the hooked
+ * processes (with daemon-socket= in the config).
+ */
+
+#define MAX_CLIENTS 16
+#define MAX_GROUPS 64
+
+#ifndef DRM_MAJOR
+#define DRM_MAJOR 226
+#endif
+
+#define EPOLL_LISTEN UINT64_MAX
+#define EPOLL_EVENT_BIT (1ULL << 32)
+
+typedef struct {
+  int sock;
+  struct ucred cred; /* Of the peer process */
+  int drm_fd;
+  int event_fd;
+  drm_ring *ring;
+
+  /* The ring's latest slots applied so far */
+  uint32_t coalesced;
+  uint32_t latest_seqs[DRM_RING_MAX_CRTCS];
+  int latest_pending;
+} drm_daemon_client;
+
+static drm_daemon_client g_clients[MAX_CLIENTS];
+static int g_epoll_fd = -1;
+
+/**
+ * Apply the latest positions coalesced by the client, that follow the ring
+ * entries before head.
+ * Returns the number of ones left for later.
+ */
+static int drm_daemon_apply_latest(drm_daemon_client *client, uint32_t head)
+{
+  drm_cursor_pos positions[DRM_RING_MAX_CRTCS];
+  drm_ring *ring = client->ring;
+  uint64_t timestamp = 0, ts;
+  uint32_t seq, pos;
+  int i, count = 0, pending = 0;
+
+  for (i = 0; i < DRM_RING_MAX_CRTCS; i++) {
+    drm_ring_latest *latest = &ring->latest[i];
+    drm_cursor_pos *position = &positions[count];
+
+    seq = __atomic_load_n(&latest->seq, __ATOMIC_ACQUIRE);
+    if (seq == client->latest_seqs[i])
+      continue;
+
+    pos = __atomic_load_n(&latest->pos, __ATOMIC_RELAXED);
+    position->crtc_id = __atomic_load_n(&latest->crtc_id, __ATOMIC_RELAXED);
+    position->x = __atomic_load_n(&latest->x, __ATOMIC_RELAXED);
+    position->y = __atomic_load_n(&latest->y, __ATOMIC_RELAXED);
+    ts = __atomic_load_n(&latest->timestamp, __ATOMIC_RELAXED);
+
+    /* Being written, the client bumps coalesced after that */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq & 1 || __atomic_load_n(&latest->seq, __ATOMIC_RELAXED) != seq) {
+      pending++;
+      continue;
+    }
+
+    /* Older entries queued before it */
+    if ((int32_t)(pos - head) > 0) {
+      pending++;
+      continue;
+    }
+
+    client->latest_seqs[i] = seq;
+    if (ts > timestamp)
+      timestamp = ts;
+    count++;
+  }
+
+  if (count == 1)
+    drm_cursor_move(client->drm_fd, positions[0].crtc_id,
+                    positions[0].x, positions[0].y, timestamp);
+  else if (count > 1)
+    drm_cursor_move_batch(client->drm_fd, positions, count, timestamp);
+
+  return pending;
+}
+
+static void drm_daemon_drain(drm_daemon_client *client)
+{
+  drm_cursor_pos positions[DRM_RING_SIZE];
+  drm_ring *ring = client->ring;
+  uint32_t head, tail, coalesced;
+  int i, count;
+
+  if (!ring)
+    return;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  while (1) {
+    /* Paired with the client's bumping coalesced and then checking head */
+    coalesced = __atomic_load_n(&ring->coalesced, __ATOMIC_SEQ_CST);
+    if (coalesced != client->coalesced) {
+      client->coalesced = coalesced;
+      client->latest_pending = 1;
+    }
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+    if (client->latest_pending)
+      client->latest_pending = drm_daemon_apply_latest(client, head);
+
+    if (head == tail)
+      break;
+
+    /* Broken client */
+    if (tail - head > DRM_RING_SIZE)
+      head = tail - DRM_RING_SIZE;
+
+    while (head != tail) {
+      drm_ring_entry *entry = &ring->entries[head % DRM_RING_SIZE];
+
+      count = entry->count;
+      if (count <= 0 || (uint32_t)count > tail - head)
+        count = 1;
+
+      for (i = 0; i < count; i++) {
+        drm_ring_entry *e = &ring->entries[(head + i) % DRM_RING_SIZE];
+
+        positions[i].crtc_id = e->crtc_id;
+        positions[i].x = e->x;
+        positions[i].y = e->y;
+      }
+
+      /* The workers coalesce them, only the newest gets committed */
+      if (count == 1)
+        drm_cursor_move(client->drm_fd, positions[0].crtc_id,
+                        positions[0].x, positions[0].y, entry->timestamp);
+      else
+        drm_cursor_move_batch(client->drm_fd, positions, count,
+                              entry->timestamp);
+
+      head += count;
+
+      /* The ones coalesced right after this batch */
+      if (client->latest_pending)
+        client->latest_pending = drm_daemon_apply_latest(client, head);
+    }
+
+    /* Paired with the client's storing tail and then checking head */
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void drm_daemon_release(drm_daemon_client *client)
+{
+  if (client->ring)
+    munmap(client->ring, sizeof(drm_ring));
+  client->ring = NULL;
+
+  if (client->event_fd >= 0) {
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, client->event_fd, NULL);
+    close(client->event_fd);
+  }
+  client->event_fd = -1;
+
+  /* Don't hold the client's file, it might be the DRM master */
+  if (client->drm_fd >= 0) {
+    drm_daemon_detach(client->drm_fd);
+    close(client->drm_fd);
+  }
+  client->drm_fd = -1;
+}
+
+static void drm_daemon_close(drm_daemon_client *client)
+{
+  DRM_INFO("daemon: client %d closed\n", client->sock);
+
+  drm_daemon_release(client);
+
+  epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, client->sock, NULL);
+  close(client->sock);
+  client->sock = -1;
+}
+
+static int drm_daemon_hello(drm_daemon_client *client, int *fds)
+{
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.u64 = (client - g_clients) | EPOLL_EVENT_BIT,
+  };
+  drm_ring *ring;
+
+  ring = mmap(NULL, sizeof(drm_ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+              fds[1], 0);
+  if (ring == MAP_FAILED)
+    return -1;
+
+  drm_daemon_release(client);
+
+  client->drm_fd = fds[0];
+  client->ring = ring;
+  client->event_fd = fds[2];
+  close(fds[1]);
+
+  /* Only the ones coalesced from now on */
+  client->coalesced = __atomic_load_n(&ring->coalesced, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < DRM_RING_MAX_CRTCS; i++)
+    client->latest_seqs[i] =
+      __atomic_load_n(&ring->latest[i].seq, __ATOMIC_ACQUIRE);
+  client->latest_pending = 0;
+
+  epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, client->event_fd, &ev);
+
+  DRM_INFO("daemon: client %d attached fd: %d\n",
+           client->sock, client->drm_fd);
+  return 0;
+}
+
+static void drm_daemon_handle(drm_daemon_client *client, drm_msg *msg)
+{
+  drm_msg_reply reply = { .ret = -1 };
+
+  if (client->drm_fd < 0)
+    goto out;
+
+  /* The moves before this request */
+  drm_daemon_drain(client);
+
+  switch (msg->type) {
+  case DRM_MSG_SET:
+    if (msg->count == 1)
+      reply.ret = drm_cursor_set(client->drm_fd, msg->crtc_id,
+                                 msg->handles[0], msg->width, msg->height,
+                                 msg->hot_x, msg->hot_y);
+    else if (msg->count > 1 && msg->count <= DRM_MSG_MAX_FRAMES)
+      reply.ret = drm_cursor_set_animation(client->drm_fd, msg->crtc_id,
+                                           msg->handles, msg->count,
+                                           msg->width, msg->height,
+                                           msg->hot_x, msg->hot_y,
+                                           msg->interval);
+    break;
+  case DRM_MSG_QUERY:
+    reply.ret = drm_cursor_query(client->drm_fd, msg->crtc_id, &reply.info);
+    break;
+  default:
+    DRM_ERROR("daemon: unknown request: %d\n", msg->type);
+    break;
+  }
+
+out:
+  if (send(client->sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+    DRM_DEBUG("daemon: failed to reply (%d)\n", errno);
+}
+
+/* Whether the peer's user is in the group */
+static int drm_daemon_in_group(struct ucred *cred, gid_t gid)
+{
+  gid_t groups[MAX_GROUPS];
+  int i, num_groups = MAX_GROUPS;
+  struct passwd *pw;
+
+  if (cred->gid == gid)
+    return 1;
+
+  pw = getpwuid(cred->uid);
+  if (!pw || getgrouplist(pw->pw_name, pw->pw_gid, groups, &num_groups) < 0)
+    return 0;
+
+  for (i = 0; i < num_groups; i++) {
+    if (groups[i] == gid)
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * The daemon issues ioctls (and reopens the device) as root, only accept the
+ * DRM primary nodes that the peer could open read-write by itself.
+ * ACLs are not considered.
+ */
+static int drm_daemon_is_drm(drm_daemon_client *client, int fd)
+{
+  struct ucred *cred = &client->cred;
+  struct stat st, node;
+  mode_t mode;
+  char *name;
+  int ret;
+
+  if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode) ||
+      major(st.st_rdev) != DRM_MAJOR ||
+      drmGetNodeTypeFromFd(fd) != DRM_NODE_PRIMARY)
+    return 0;
+
+  if (!cred->uid)
+    return 1;
+
+  name = drmGetDeviceNameFromFd2(fd);
+  ret = name && !stat(name, &node) && node.st_rdev == st.st_rdev;
+  free(name);
+  if (!ret)
+    return 0;
+
+  if (node.st_uid == cred->uid)
+    mode = node.st_mode >> 6;
+  else if (drm_daemon_in_group(cred, node.st_gid))
+    mode = node.st_mode >> 3;
+  else
+    mode = node.st_mode;
+
+  return (mode & 06) == 06;
+}
+
+static void drm_daemon_read(drm_daemon_client *client)
+{
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } u;
+  drm_msg msg;
+  struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+  struct msghdr mh = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = u.buf,
+    .msg_controllen = sizeof(u.buf),
+  };
+  struct cmsghdr *cmsg;
+  int fds[3], num_fds = 0, i;
+  ssize_t len;
+
+  len = recvmsg(client->sock, &mh, MSG_CMSG_CLOEXEC);
+  if (len <= 0) {
+    if (len < 0 && errno == EINTR)
+      return;
+
+    drm_daemon_close(client);
+    return;
+  }
+
+  /* Keep the first 3 fds, close all the others */
+  for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    int *data = (int *)CMSG_DATA(cmsg);
+    int n;
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < n; i++) {
+      int fd;
+
+      memcpy(&fd, data + i, sizeof(fd));
+      if (num_fds < 3)
+        fds[num_fds++] = fd;
+      else
+        close(fd);
+    }
+  }
+
+  if (len != sizeof(msg)) {
+    DRM_ERROR("daemon: invalid message\n");
+    goto err;
+  }
+
+  if (msg.type == DRM_MSG_HELLO) {
+    if (num_fds != 3 || !drm_daemon_is_drm(client, fds[0]) ||
+        drm_daemon_hello(client, fds) < 0) {
+      DRM_ERROR("daemon: invalid hello\n");
+      goto err;
+    }
+    return;
+  }
+
+  drm_daemon_handle(client, &msg);
+err:
+  for (i = 0; i < num_fds; i++)
+    close(fds[i]);
+}
+
+static void drm_daemon_accept(int listen_fd)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  int fd, i;
+
+  fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    DRM_ERROR("daemon: failed to get peer credentials (%d)\n", errno);
+    close(fd);
+    return;
+  }
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    drm_daemon_client *client = &g_clients[i];
+    if (client->sock >= 0)
+      continue;
+
+    client->sock = fd;
+    client->cred = cred;
+    ev.data.u64 = i;
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    DRM_INFO("daemon: client %d connected, pid: %d uid: %d\n",
+             fd, cred.pid, cred.uid);
+    return;
+  }
+
+  DRM_ERROR("daemon: too many clients\n");
+  close(fd);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = DRM_DAEMON_SOCKET;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EPOLL_LISTEN };
+  mode_t mode = 0600;
+  gid_t gid = -1;
+  struct group *gr;
+  int listen_fd, i, n, opt;
+
+  /* Only root by default, e.g. "-m 0660 -g video" for the video group */
+  while ((opt = getopt(argc, argv, "m:g:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mode = strtol(optarg, NULL, 8);
+      break;
+    case 'g':
+      if (!(gr = getgrnam(optarg))) {
+        fprintf(stderr, "unknown group: %s\n", optarg);
+        return -1;
+      }
+      gid = gr->gr_gid;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-m mode] [-g group] [socket]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (optind < argc)
+    path = argv[optind];
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    g_clients[i].sock = -1;
+    g_clients[i].drm_fd = -1;
+    g_clients[i].event_fd = -1;
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+    return -1;
+
+  /* Remove the stale one */
+  unlink(path);
+
+  /* Restrict the clients, before listening */
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      chmod(path, mode) < 0 ||
+      (gid != (gid_t)-1 && chown(path, -1, gid) < 0) ||
+      listen(listen_fd, MAX_CLIENTS) < 0) {
+    fprintf(stderr, "failed to listen on %s (%d)\n", path, errno);
+    return -1;
+  }
+
+  g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_epoll_fd < 0)
+    return -1;
+
+  epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+  fprintf(stderr, "cursor daemon listening on %s\n", path);
+
+  while (1) {
+    struct epoll_event events[MAX_CLIENTS * 2 + 1];
+
+    n = epoll_wait(g_epoll_fd, events, MAX_CLIENTS * 2 + 1, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      uint64_t data = events[i].data.u64;
+      drm_daemon_client *client;
+      uint64_t value;
+
+      if (data == EPOLL_LISTEN) {
+        drm_daemon_accept(listen_fd);
+        continue;
+      }
+
+      client = &g_clients[data & (EPOLL_EVENT_BIT - 1)];
+      if (data & EPOLL_EVENT_BIT) {
+        /* The eventfd might have been closed by earlier events */
+        if (client->event_fd < 0 ||
+            read(client->event_fd, &value, sizeof(value)) < 0)
+          continue;
+
+        drm_daemon_drain(client);
+      } else if (client->sock >= 0) {
+        drm_daemon_read(client);
+      }
+    }
+  }
+
+  return -1;
+}
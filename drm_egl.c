@@ -14,8 +14,13 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <malloc.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <drm.h>
 #include <xf86drm.h>
@@ -60,52 +65,398 @@ static const char fragment_shader_source[] =
 "    gl_FragColor = texture2D(tex, v_texcoord);\n"
 "}\n";
 
-/* HACK: use multiple surfaces to avoid AFBC corruption */
-#define MAX_NUM_SURFACES 64
+/* Headless, sampling the cursor uploaded from memory */
+static const char fragment_shader_source_2d[] =
+"precision mediump float;\n"
+"varying vec2 v_texcoord;\n"
+"uniform sampler2D tex;\n"
+"void main()\n"
+"{\n"
+"    gl_FragColor = texture2D(tex, v_texcoord);\n"
+"}\n";
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+#define MAX_NUM_BUFFERS 64
+
+/* On screen, just released (maybe still scanned out), and to render */
+#define MIN_NUM_BUFFERS 3
+#define MAX_NUM_POOLS 8
+
+/* Render target of a bo, the FBO renders into it through an EGL image */
+typedef struct {
+  struct gbm_bo *bo;
+  EGLImageKHR image;
+  GLuint texture;
+  GLuint fbo;
+} egl_target;
+
+/* Pooled buffer, reusable once its FB is released and off the screen */
+typedef struct {
+  egl_target target;
+  uint32_t fb;
+  uint64_t size;
+} egl_pooled;
+
+/* Buffers of the same size and format, grown as needed up to max_buffers */
+typedef struct {
+  int width; /* 0 for unused */
+  int height;
+  uint32_t format;
+  uint64_t modifier;
+
+  egl_pooled buffers[MAX_NUM_BUFFERS];
+  int num_buffers;
+  int next_buffer;
+
+  /* Released last, could still be scanned out by a pending commit */
+  int last_released;
+
+  uint64_t last_used;
+} egl_pool;
 
 typedef struct {
   struct gbm_device *gbm_dev;
-  struct gbm_surface *gbm_surfaces[MAX_NUM_SURFACES];
 
   EGLDisplay egl_display;
   EGLContext egl_context;
   EGLConfig egl_config;
-  EGLSurface egl_surfaces[MAX_NUM_SURFACES];
   GLuint vertex_shader, fragment_shader, program;
 
-  int width;
-  int height;
+  /* Dummy surface to bind, without EGL_KHR_surfaceless_context */
+  struct gbm_surface *gbm_surface;
+  EGLSurface egl_surface;
 
   int format;
   uint64_t modifier;
 
-  int current_surface;
-  int num_surfaces;
+  /* Surfaceless platform without GBM, converting from/to memory */
+  int headless;
+  int has_bgra;
+  egl_target mem_target;
+  int mem_width;
+  int mem_height;
+
+  /* Pools of recent sizes, LRU ones are freed when over the budget */
+  egl_pool pools[MAX_NUM_POOLS];
+  int max_buffers;
+  uint64_t pool_budget;
+  uint64_t pool_seq;
 } egl_ctx;
 
+/* Standalone buffer, owned by the caller, no bo when shared from another */
+typedef struct {
+  struct gbm_bo *bo;
+  uint32_t fb;
+
+  uint32_t format;
+  uint64_t modifier;
+} egl_buffer;
+
+static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d = NULL;
+static PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
+static PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
+static PFNGLGETPROGRAMBINARYOESPROC get_program_binary = NULL;
+static PFNGLPROGRAMBINARYOESPROC program_binary = NULL;
+
+static int egl_load_procs(void)
+{
+  if (!create_image)
+    EGL_LOAD_PROC(create_image, PFNEGLCREATEIMAGEKHRPROC,
+                  "eglCreateImageKHR");
+
+  if (!destroy_image)
+    EGL_LOAD_PROC(destroy_image, PFNEGLDESTROYIMAGEKHRPROC,
+                  "eglDestroyImageKHR");
+
+  if (!image_target_texture_2d)
+    EGL_LOAD_PROC(image_target_texture_2d, PFNGLEGLIMAGETARGETTEXTURE2DOESPROC,
+                  "glEGLImageTargetTexture2DOES");
+
+  if (!create_image || !destroy_image || !image_target_texture_2d) {
+    DRM_ERROR("failed to get proc address\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static EGLImageKHR egl_create_bo_image(egl_ctx *ctx, struct gbm_bo *bo,
+                                       uint32_t format, uint64_t modifier)
+{
+  EGLImageKHR image;
+  int bo_fd = gbm_bo_get_fd(bo);
+
+  const EGLint attrs[] = {
+    EGL_WIDTH, gbm_bo_get_width(bo),
+    EGL_HEIGHT, gbm_bo_get_height(bo),
+    EGL_LINUX_DRM_FOURCC_EXT, format,
+    EGL_DMA_BUF_PLANE0_FD_EXT, bo_fd,
+    EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+    EGL_DMA_BUF_PLANE0_PITCH_EXT, gbm_bo_get_stride(bo),
+    EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, modifier & 0xFFFFFFFF,
+    EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT, modifier >> 32,
+    EGL_NONE,
+  };
+
+  if (bo_fd < 0) {
+    DRM_ERROR("failed to export bo\n");
+    return EGL_NO_IMAGE;
+  }
+
+  image = create_image(ctx->egl_display, EGL_NO_CONTEXT,
+                       EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
+  close(bo_fd);
+
+  if (image == EGL_NO_IMAGE)
+    DRM_ERROR("failed to create bo image: 0x%x\n", eglGetError());
+
+  return image;
+}
+
+/* Release the GL side of the target, keeping the bo */
+static void egl_release_target(egl_ctx *ctx, egl_target *target)
+{
+  if (target->fbo)
+    glDeleteFramebuffers(1, &target->fbo);
+
+  if (target->texture)
+    glDeleteTextures(1, &target->texture);
+
+  if (target->image != EGL_NO_IMAGE)
+    destroy_image(ctx->egl_display, target->image);
+
+  target->fbo = target->texture = 0;
+  target->image = EGL_NO_IMAGE;
+}
+
+static void egl_free_target(egl_ctx *ctx, egl_target *target)
+{
+  egl_release_target(ctx, target);
+
+  if (target->bo)
+    gbm_bo_destroy(target->bo);
+
+  target->bo = NULL;
+}
+
+static int egl_init_target(egl_ctx *ctx, egl_target *target,
+                           int width, int height,
+                           uint32_t format, uint64_t modifier)
+{
+  memset(target, 0, sizeof(*target));
+  target->image = EGL_NO_IMAGE;
+
+  if (!modifier)
+    target->bo = gbm_bo_create(ctx->gbm_dev, width, height, format,
+                               GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+  else
+    target->bo = gbm_bo_create_with_modifiers(ctx->gbm_dev, width, height,
+                                              format, &modifier, 1);
+  if (!target->bo) {
+    DRM_ERROR("failed to create bo\n");
+    return -1;
+  }
+
+  target->image = egl_create_bo_image(ctx, target->bo, format, modifier);
+  if (target->image == EGL_NO_IMAGE)
+    goto err;
+
+  glGenTextures(1, &target->texture);
+  glBindTexture(GL_TEXTURE_2D, target->texture);
+  image_target_texture_2d(GL_TEXTURE_2D, (GLeglImageOES)target->image);
+
+  glGenFramebuffers(1, &target->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         GL_TEXTURE_2D, target->texture, 0);
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    DRM_ERROR("incomplete framebuffer\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    goto err;
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  return 0;
+err:
+  egl_free_target(ctx, target);
+  return -1;
+}
+
+static uint64_t egl_pool_size(egl_pool *pool)
+{
+  uint64_t size = 0;
+  int i;
+
+  for (i = 0; i < pool->num_buffers; i++)
+    size += pool->buffers[i].size;
+
+  return size;
+}
+
+/* Free the pooled buffers, the kernel keeps the live FBs' memory */
+static void egl_free_pool(egl_ctx *ctx, egl_pool *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->num_buffers; i++)
+    egl_free_target(ctx, &pool->buffers[i].target);
+
+  memset(pool, 0, sizeof(*pool));
+}
+
+static egl_pool *egl_lru_pool(egl_ctx *ctx, egl_pool *keep)
+{
+  egl_pool *pool, *lru = NULL;
+  int i;
+
+  for (i = 0; i < MAX_NUM_POOLS; i++) {
+    pool = &ctx->pools[i];
+    if (!pool->width || pool == keep)
+      continue;
+
+    if (!lru || pool->last_used < lru->last_used)
+      lru = pool;
+  }
+
+  return lru;
+}
+
+/* Free LRU pools until the others fit in the budget */
+static void egl_trim_pools(egl_ctx *ctx, egl_pool *keep)
+{
+  egl_pool *lru;
+  uint64_t size = 0;
+  int i;
+
+  for (i = 0; i < MAX_NUM_POOLS; i++) {
+    if (&ctx->pools[i] != keep)
+      size += egl_pool_size(&ctx->pools[i]);
+  }
+
+  while (size > ctx->pool_budget && (lru = egl_lru_pool(ctx, keep))) {
+    DRM_DEBUG("evict pool: %dx%d\n", lru->width, lru->height);
+    size -= egl_pool_size(lru);
+    egl_free_pool(ctx, lru);
+  }
+}
+
+static egl_pool *egl_get_pool(egl_ctx *ctx, int width, int height,
+                              uint32_t format, uint64_t modifier)
+{
+  egl_pool *pool, *unused = NULL;
+  int i;
+
+  for (i = 0; i < MAX_NUM_POOLS; i++) {
+    pool = &ctx->pools[i];
+    if (!pool->width) {
+      if (!unused)
+        unused = pool;
+      continue;
+    }
+
+    if (pool->width == width && pool->height == height &&
+        pool->format == format && pool->modifier == modifier)
+      goto out;
+  }
+
+  pool = unused;
+  if (!pool) {
+    pool = egl_lru_pool(ctx, NULL);
+    DRM_DEBUG("evict pool: %dx%d\n", pool->width, pool->height);
+    egl_free_pool(ctx, pool);
+  }
+
+  pool->width = width;
+  pool->height = height;
+  pool->format = format;
+  pool->modifier = modifier;
+  pool->last_released = -1;
+out:
+  pool->last_used = ++ctx->pool_seq;
+  return pool;
+}
+
+/**
+ * Get a buffer that is neither used by a FB nor possibly scanned out,
+ * allocating one when all of them are in flight.
+ */
+static egl_pooled *egl_get_pooled(egl_ctx *ctx, egl_pool *pool)
+{
+  egl_pooled *pooled;
+  int i, n;
+
+  for (i = 0; i < pool->num_buffers; i++) {
+    n = (pool->next_buffer + i) % pool->num_buffers;
+    if (!pool->buffers[n].fb && n != pool->last_released)
+      goto out;
+  }
+
+  if (pool->num_buffers < ctx->max_buffers) {
+    n = pool->num_buffers;
+    pooled = &pool->buffers[n];
+    if (egl_init_target(ctx, &pooled->target, pool->width, pool->height,
+                        pool->format, pool->modifier) < 0)
+      return NULL;
+
+    pooled->fb = 0;
+    pooled->size = (uint64_t)gbm_bo_get_stride(pooled->target.bo) *
+      gbm_bo_get_height(pooled->target.bo);
+    pool->num_buffers++;
+
+    DRM_DEBUG("%d buffers in flight, grow %dx%d pool to %d\n",
+              pool->num_buffers - 1, pool->width, pool->height,
+              pool->num_buffers);
+
+    egl_trim_pools(ctx, pool);
+    goto out;
+  }
+
+  /* Rendering into a scanned out buffer tears (and corrupts AFBC ones) */
+  DRM_ERROR("all %d buffers of %dx%d pool in flight\n",
+            pool->num_buffers, pool->width, pool->height);
+  return NULL;
+out:
+  if (n == pool->last_released)
+    pool->last_released = -1;
+
+  pool->next_buffer = n + 1;
+  return &pool->buffers[n];
+}
+
 drm_private void egl_free_ctx(void *data)
 {
   egl_ctx *ctx = data;
   int i;
 
   if (ctx->egl_display != EGL_NO_DISPLAY) {
-    eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                   EGL_NO_CONTEXT);
+    if (ctx->egl_context != EGL_NO_CONTEXT) {
+      eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface,
+                     ctx->egl_context);
+      for (i = 0; i < MAX_NUM_POOLS; i++)
+        egl_free_pool(ctx, &ctx->pools[i]);
 
-    if (ctx->program)
-      glDeleteProgram(ctx->program);
+      egl_release_target(ctx, &ctx->mem_target);
 
-    if (ctx->fragment_shader)
-      glDeleteShader(ctx->fragment_shader);
+      if (ctx->program)
+        glDeleteProgram(ctx->program);
 
-    if (ctx->vertex_shader)
-      glDeleteShader(ctx->vertex_shader);
+      if (ctx->fragment_shader)
+        glDeleteShader(ctx->fragment_shader);
 
-    for (i = 0; i < ctx->num_surfaces; i++) {
-      if (ctx->egl_surfaces[i] != EGL_NO_SURFACE)
-        eglDestroySurface(ctx->egl_display, ctx->egl_surfaces[i]);
+      if (ctx->vertex_shader)
+        glDeleteShader(ctx->vertex_shader);
     }
 
+    eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+
+    if (ctx->egl_surface != EGL_NO_SURFACE)
+      eglDestroySurface(ctx->egl_display, ctx->egl_surface);
+
     if (ctx->egl_context != EGL_NO_CONTEXT)
       eglDestroyContext(ctx->egl_display, ctx->egl_context);
 
@@ -113,10 +464,8 @@ drm_private void egl_free_ctx(void *data)
     eglReleaseThread();
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->gbm_surfaces[i])
-      gbm_surface_destroy(ctx->gbm_surfaces[i]);
-  }
+  if (ctx->gbm_surface)
+    gbm_surface_destroy(ctx->gbm_surface);
 
   if (ctx->gbm_dev)
     gbm_device_destroy(ctx->gbm_dev);
@@ -124,82 +473,381 @@ drm_private void egl_free_ctx(void *data)
   free(ctx);
 }
 
-static int egl_flush_surfaces(egl_ctx *ctx)
+/* Bind the context, everything renders into FBOs */
+static int egl_bind_context(egl_ctx *ctx)
 {
-  int i;
+  const char *extensions;
 
-  /* Re-create surfaces */
+  if (ctx->egl_surface != EGL_NO_SURFACE)
+    goto bind;
 
-  eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                 EGL_NO_CONTEXT);
+  if (!ctx->gbm_dev) {
+    if (eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       ctx->egl_context))
+      return 0;
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->egl_surfaces[i] != EGL_NO_SURFACE) {
-      eglDestroySurface(ctx->egl_display, ctx->egl_surfaces[i]);
-      ctx->egl_surfaces[i] = EGL_NO_SURFACE;
-    }
+    DRM_ERROR("failed to make context current\n");
+    return -1;
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->gbm_surfaces[i]) {
-      gbm_surface_destroy(ctx->gbm_surfaces[i]);
-      ctx->gbm_surfaces[i] = NULL;
-    }
+  extensions = eglQueryString(ctx->egl_display, EGL_EXTENSIONS);
+  if (extensions && strstr(extensions, "EGL_KHR_surfaceless_context") &&
+      eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                     ctx->egl_context))
+    return 0;
+
+  DRM_DEBUG("no surfaceless context, using a dummy surface\n");
+
+  ctx->gbm_surface = gbm_surface_create(ctx->gbm_dev, 16, 16, ctx->format,
+                                        GBM_BO_USE_RENDERING);
+  if (!ctx->gbm_surface) {
+    DRM_ERROR("failed to create GBM surface\n");
+    return -1;
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (!ctx->modifier)
-      ctx->gbm_surfaces[i] =
-        gbm_surface_create(ctx->gbm_dev, ctx->width, ctx->height,
-                           ctx->format, 0);
-    else
-      ctx->gbm_surfaces[i] =
-        gbm_surface_create_with_modifiers(ctx->gbm_dev,
-                                          ctx->width, ctx->height,
-                                          ctx->format, &ctx->modifier, 1);
-    if (!ctx->gbm_surfaces[i]) {
-      DRM_ERROR("failed to create GBM surface\n");
-      return -1;
+  ctx->egl_surface =
+    eglCreateWindowSurface(ctx->egl_display, ctx->egl_config,
+                           (EGLNativeWindowType)ctx->gbm_surface, NULL);
+  if (ctx->egl_surface == EGL_NO_SURFACE) {
+    DRM_ERROR("failed to create EGL surface\n");
+    return -1;
+  }
+bind:
+  if (!eglMakeCurrent(ctx->egl_display, ctx->egl_surface, ctx->egl_surface,
+                      ctx->egl_context)) {
+    DRM_ERROR("failed to make context current\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Check that GBM/EGL could render into the format and modifier */
+static int egl_check_format(egl_ctx *ctx)
+{
+  PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_modifiers;
+  EGLuint64KHR modifiers[64];
+  EGLBoolean external_only[64];
+  EGLint num_modifiers = 0, i;
+  struct gbm_bo *bo;
+
+  if (ctx->modifier == DRM_FORMAT_MOD_LINEAR)
+    return 0;
+
+  EGL_LOAD_PROC(query_modifiers, PFNEGLQUERYDMABUFMODIFIERSEXTPROC,
+                "eglQueryDmaBufModifiersEXT");
+  if (query_modifiers &&
+      query_modifiers(ctx->egl_display, ctx->format, 64, modifiers,
+                      external_only, &num_modifiers)) {
+    for (i = 0; i < num_modifiers; i++) {
+      if (modifiers[i] == ctx->modifier && !external_only[i])
+        break;
     }
 
-    ctx->egl_surfaces[i] =
-      eglCreateWindowSurface(ctx->egl_display, ctx->egl_config,
-                             (EGLNativeWindowType)ctx->gbm_surfaces[i], NULL);
-    if (ctx->egl_surfaces[i] == EGL_NO_SURFACE) {
-      DRM_ERROR("failed to create EGL surface\n");
+    if (i == num_modifiers)
       return -1;
-    }
   }
 
-  ctx->current_surface = 0;
+  bo = gbm_bo_create_with_modifiers(ctx->gbm_dev, 64, 64, ctx->format,
+                                    &ctx->modifier, 1);
+  if (!bo)
+    return -1;
+
+  gbm_bo_destroy(bo);
   return 0;
 }
 
-drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
-                               uint64_t modifier)
+static const char *egl_fragment_source(egl_ctx *ctx)
 {
-  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  return ctx->headless ? fragment_shader_source_2d : fragment_shader_source;
+}
+
+static int egl_build_program(egl_ctx *ctx)
+{
+  const char *source;
+  char msg[512];
+  GLint status;
+
+  source = vertex_shader_source;
+  ctx->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(ctx->vertex_shader, 1, &source, NULL);
+  glCompileShader(ctx->vertex_shader);
+  glGetShaderiv(ctx->vertex_shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    glGetShaderInfoLog(ctx->vertex_shader, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to compile shader: %s\n", msg);
+    return -1;
+  }
+
+  source = egl_fragment_source(ctx);
+  ctx->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(ctx->fragment_shader, 1, &source, NULL);
+  glCompileShader(ctx->fragment_shader);
+  glGetShaderiv(ctx->fragment_shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    glGetShaderInfoLog(ctx->fragment_shader, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to compile shader: %s\n", msg);
+    return -1;
+  }
+
+  ctx->program = glCreateProgram();
+  glAttachShader(ctx->program, ctx->vertex_shader);
+  glAttachShader(ctx->program, ctx->fragment_shader);
+  glLinkProgram(ctx->program);
+
+  glGetProgramiv(ctx->program, GL_LINK_STATUS, &status);
+  if (!status) {
+    glGetProgramInfoLog(ctx->program, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to link: %s\n", msg);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* The program binary is only valid for the same GL driver and sources */
+static int egl_program_cache_path(egl_ctx *ctx, const char *dir,
+                                  char *path, size_t size)
+{
+  const char *strs[] = {
+    (const char *)glGetString(GL_VENDOR),
+    (const char *)glGetString(GL_RENDERER),
+    (const char *)glGetString(GL_VERSION),
+    vertex_shader_source,
+    egl_fragment_source(ctx),
+  };
+  const char *exts = (const char *)glGetString(GL_EXTENSIONS);
+  uint64_t hash = DRM_HASH_INIT;
+  unsigned i;
+
+  if (!exts || !strstr(exts, "GL_OES_get_program_binary"))
+    return -1;
+
+  if (!get_program_binary)
+    EGL_LOAD_PROC(get_program_binary, PFNGLGETPROGRAMBINARYOESPROC,
+                  "glGetProgramBinaryOES");
+
+  if (!program_binary)
+    EGL_LOAD_PROC(program_binary, PFNGLPROGRAMBINARYOESPROC,
+                  "glProgramBinaryOES");
 
+  if (!get_program_binary || !program_binary)
+    return -1;
+
+  for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+    if (strs[i])
+      hash = drm_hash(hash, strs[i], strlen(strs[i]) + 1);
+  }
+
+  snprintf(path, size, "%s/program-%016"PRIx64, dir, hash);
+  return 0;
+}
+
+static int egl_load_program(egl_ctx *ctx, const char *path)
+{
+  GLenum binary_format;
+  GLint status = 0;
+  void *binary;
+  long size;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    return -1;
+
+  if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) <= 0 ||
+      (size_t)size <= sizeof(binary_format) || fseek(fp, 0, SEEK_SET) < 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  size -= sizeof(binary_format);
+  binary = malloc(size);
+  if (!binary ||
+      fread(&binary_format, sizeof(binary_format), 1, fp) != 1 ||
+      fread(binary, size, 1, fp) != 1) {
+    free(binary);
+    fclose(fp);
+    return -1;
+  }
+
+  fclose(fp);
+
+  ctx->program = glCreateProgram();
+  program_binary(ctx->program, binary_format, binary, size);
+  free(binary);
+
+  /* Rejected by the driver, e.g. after updating */
+  glGetProgramiv(ctx->program, GL_LINK_STATUS, &status);
+  if (!status) {
+    DRM_DEBUG("stale program binary: %s\n", path);
+    glDeleteProgram(ctx->program);
+    ctx->program = 0;
+    return -1;
+  }
+
+  DRM_DEBUG("loaded program binary: %s\n", path);
+  return 0;
+}
+
+static void egl_save_program(egl_ctx *ctx, const char *dir, const char *path)
+{
+  GLenum binary_format;
+  GLint size = 0;
+  char tmp[PATH_MAX];
+  void *binary;
+  FILE *fp;
+
+  glGetProgramiv(ctx->program, GL_PROGRAM_BINARY_LENGTH_OES, &size);
+  if (size <= 0)
+    return;
+
+  binary = malloc(size);
+  if (!binary)
+    return;
+
+  get_program_binary(ctx->program, size, &size, &binary_format, binary);
+  if (glGetError() != GL_NO_ERROR || size <= 0)
+    goto out;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    goto out;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+  fp = fopen(tmp, "wb");
+  if (!fp)
+    goto out;
+
+  if (fwrite(&binary_format, sizeof(binary_format), 1, fp) != 1 ||
+      fwrite(binary, size, 1, fp) != 1 || fclose(fp) ||
+      rename(tmp, path) < 0) {
+    unlink(tmp);
+    goto out;
+  }
+
+  DRM_DEBUG("saved program binary: %s\n", path);
+out:
+  free(binary);
+}
+
+/* Create the GL context and the conversion program */
+static int egl_init_gl(egl_ctx *ctx, const char *cache_dir)
+{
   EGLConfig *configs;
   EGLint num_configs;
-  egl_ctx *ctx;
 
+  char path[PATH_MAX];
   GLint texcoord;
-  GLint status;
-  const char *source;
-  char msg[512];
   int i;
 
-  static const EGLint context_attribs[] = {
-    EGL_CONTEXT_CLIENT_VERSION, 2,
-    EGL_NONE
-  };
+  static const EGLint context_attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+
+  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+    DRM_ERROR("failed to bind api\n");
+    return -1;
+  }
+
+  if (!eglGetConfigs(ctx->egl_display, NULL, 0, &num_configs) ||
+      num_configs < 1) {
+    DRM_ERROR("failed to get configs\n");
+    return -1;
+  }
+
+  configs = calloc(num_configs, sizeof(*configs));
+  if (!configs) {
+    DRM_ERROR("failed to alloc configs\n");
+    return -1;
+  }
+
+  if (!eglGetConfigs(ctx->egl_display, configs, num_configs, &num_configs)) {
+    DRM_ERROR("failed to get configs\n");
+    free(configs);
+    return -1;
+  }
+
+  for (i = 0; i < num_configs && !ctx->headless; i++) {
+    EGLint value;
+
+    if (!eglGetConfigAttrib(ctx->egl_display, configs[i],
+                            EGL_NATIVE_VISUAL_ID, &value))
+      continue;
+
+    if (value == ctx->format)
+      break;
+  }
+
+  /* Headless renders into FBOs only, any config works */
+  if (ctx->headless) {
+    ctx->egl_config = configs[0];
+  } else if (i == num_configs) {
+    DRM_ERROR("failed to find EGL config for %.4s, force using the first\n",
+              (char *)&ctx->format);
+    ctx->egl_config = configs[0];
+  } else {
+    ctx->egl_config = configs[i];
+  }
+
+  free(configs);
+
+  ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config,
+                                      EGL_NO_CONTEXT, context_attribs);
+  if (ctx->egl_context == EGL_NO_CONTEXT) {
+    DRM_ERROR("failed to create EGL context\n");
+    return -1;
+  }
+
+  if (egl_bind_context(ctx) < 0)
+    return -1;
+
+  if (egl_load_procs() < 0)
+    return -1;
+
+  /* Keep reduced-depth conversions lossless */
+  glDisable(GL_DITHER);
+
+  /* Compiling takes long on some drivers, try the cached binary first */
+  if (cache_dir &&
+      egl_program_cache_path(ctx, cache_dir, path, sizeof(path)) < 0)
+    cache_dir = NULL;
+
+  if (!cache_dir || egl_load_program(ctx, path) < 0) {
+    if (egl_build_program(ctx) < 0)
+      return -1;
+
+    if (cache_dir)
+      egl_save_program(ctx, cache_dir, path);
+  }
+
+  glUseProgram(ctx->program);
+
+  texcoord = glGetAttribLocation(ctx->program, "texcoord");
+  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+  glEnableVertexAttribArray(texcoord);
+
+  glUniform1i(glGetUniformLocation(ctx->program, "tex"), 0);
+
+  return 0;
+}
 
-  if (num_surfaces > MAX_NUM_SURFACES) {
-    DRM_ERROR("too much surfaces: %d > %d\n", num_surfaces, MAX_NUM_SURFACES);
+drm_private void *egl_init_ctx(int fd, int max_buffers, uint64_t pool_budget,
+                               int format, uint64_t modifier,
+                               const char *cache_dir)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  egl_ctx *ctx;
+
+  if (max_buffers > MAX_NUM_BUFFERS) {
+    DRM_ERROR("too much buffers: %d > %d\n", max_buffers, MAX_NUM_BUFFERS);
     return NULL;
   }
 
+  /* Never have to recycle a buffer in flight */
+  if (max_buffers < MIN_NUM_BUFFERS)
+    max_buffers = MIN_NUM_BUFFERS;
+
   EGL_LOAD_PROC(get_platform_display, PFNEGLGETPLATFORMDISPLAYEXTPROC,
                 "eglGetPlatformDisplayEXT");
   if (!get_platform_display) {
@@ -215,11 +863,9 @@ drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
 
   ctx->format = format;
   ctx->modifier = modifier;
-  ctx->num_surfaces = num_surfaces;
-  ctx->width = ctx->height = 0;
-
-  for (i = 0; i < ctx->num_surfaces; i++)
-    ctx->egl_surfaces[i] = EGL_NO_SURFACE;
+  ctx->max_buffers = max_buffers;
+  ctx->pool_budget = pool_budget;
+  ctx->egl_surface = EGL_NO_SURFACE;
 
   ctx->gbm_dev = gbm_create_device(fd);
   if (!ctx->gbm_dev) {
@@ -239,99 +885,68 @@ drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
     goto err;
   }
 
-  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
-    DRM_ERROR("failed to bind api\n");
-    goto err;
-  }
-
-  if (!eglGetConfigs(ctx->egl_display, NULL, 0, &num_configs) ||
-      num_configs < 1) {
-    DRM_ERROR("failed to get configs\n");
-    goto err;
-  }
-
-  configs = calloc(num_configs, sizeof(*configs));
-  if (!configs) {
-    DRM_ERROR("failed to alloc configs\n");
+  if (egl_check_format(ctx) < 0) {
+    DRM_DEBUG("unable to render %.4s:%#"PRIx64"\n",
+              (char *)&format, modifier);
     goto err;
   }
 
-  if (!eglGetConfigs(ctx->egl_display, configs, num_configs, &num_configs)) {
-    DRM_ERROR("failed to get configs\n");
+  if (egl_init_gl(ctx, cache_dir) < 0)
     goto err;
-  }
-
-  for (i = 0; i < num_configs; i++) {
-    EGLint value;
 
-    if (!eglGetConfigAttrib(ctx->egl_display, configs[i],
-                            EGL_NATIVE_VISUAL_ID, &value))
-      continue;
+  return ctx;
+err:
+  egl_free_ctx(ctx);
+  return NULL;
+}
 
-    if (value == format)
-      break;
-  }
+/**
+ * Headless ctx on the surfaceless platform (e.g. Mesa llvmpipe), without
+ * display GPU, converting with egl_convert_pixels() for benchmarking.
+ */
+drm_private void *egl_init_headless(const char *cache_dir)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  const char *exts;
+  egl_ctx *ctx;
 
-  if (i == num_configs) {
-    DRM_ERROR("failed to find EGL config for %.4s, force using the first\n",
-              (char *)&format);
-    ctx->egl_config = configs[0];
-  } else {
-    ctx->egl_config = configs[i];
+  EGL_LOAD_PROC(get_platform_display, PFNEGLGETPLATFORMDISPLAYEXTPROC,
+                "eglGetPlatformDisplayEXT");
+  if (!get_platform_display) {
+    DRM_ERROR("failed to get proc address\n");
+    return NULL;
   }
 
-  ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config,
-                                      EGL_NO_CONTEXT, context_attribs);
-  if (ctx->egl_context == EGL_NO_CONTEXT) {
-    DRM_ERROR("failed to create EGL context\n");
-    goto err;
+  ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    DRM_ERROR("failed to alloc ctx\n");
+    return NULL;
   }
 
-  eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                 ctx->egl_context);
+  ctx->headless = 1;
+  ctx->format = DRM_FORMAT_ABGR8888;
+  ctx->egl_surface = EGL_NO_SURFACE;
+  ctx->mem_target.image = EGL_NO_IMAGE;
 
-  source = vertex_shader_source;
-  ctx->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(ctx->vertex_shader, 1, &source, NULL);
-  glCompileShader(ctx->vertex_shader);
-  glGetShaderiv(ctx->vertex_shader, GL_COMPILE_STATUS, &status);
-  if (!status) {
-    glGetShaderInfoLog(ctx->vertex_shader, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to compile shader: %s\n", msg);
+  ctx->egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                          EGL_DEFAULT_DISPLAY, NULL);
+  if (ctx->egl_display == EGL_NO_DISPLAY) {
+    DRM_ERROR("failed to get surfaceless display\n");
     goto err;
   }
 
-  source = fragment_shader_source;
-  ctx->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(ctx->fragment_shader, 1, &source, NULL);
-  glCompileShader(ctx->fragment_shader);
-  glGetShaderiv(ctx->fragment_shader, GL_COMPILE_STATUS, &status);
-  if (!status) {
-    glGetShaderInfoLog(ctx->fragment_shader, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to compile shader: %s\n", msg);
+  if (!eglInitialize(ctx->egl_display, NULL, NULL)) {
+    DRM_ERROR("failed to init egl\n");
     goto err;
   }
 
-  ctx->program = glCreateProgram();
-  glAttachShader(ctx->program, ctx->vertex_shader);
-  glAttachShader(ctx->program, ctx->fragment_shader);
-  glLinkProgram(ctx->program);
-
-  glGetProgramiv(ctx->program, GL_LINK_STATUS, &status);
-  if (!status) {
-    glGetProgramInfoLog(ctx->program, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to link: %s\n", msg);
+  if (egl_init_gl(ctx, cache_dir) < 0)
     goto err;
-  }
-
-  glUseProgram(ctx->program);
-
-  texcoord = glGetAttribLocation(ctx->program, "texcoord");
-  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
-  glEnableVertexAttribArray(texcoord);
 
-  glUniform1i(glGetUniformLocation(ctx->program, "tex"), 0);
+  exts = (const char *)glGetString(GL_EXTENSIONS);
+  ctx->has_bgra = exts && strstr(exts, "GL_EXT_texture_format_BGRA8888");
 
+  DRM_INFO("headless renderer: %s\n", glGetString(GL_RENDERER));
   return ctx;
 err:
   egl_free_ctx(ctx);
@@ -355,9 +970,12 @@ static uint32_t egl_bo_to_fb(int fd, struct gbm_bo* bo, int format,
   strides[0] = gbm_bo_get_stride(bo);
   modifiers[0] = modifier;
 
-  if (!modifier)
+  if (!modifier && format == DRM_FORMAT_ARGB8888)
     ret = drmModeAddFB(fd, width, height, bpp, bpp,
                        strides[0], handles[0], &fb);
+  else if (!modifier)
+    ret = drmModeAddFB2(fd, width, height, format,
+                        handles, strides, offsets, &fb, 0);
   else
     ret = drmModeAddFB2WithModifiers(fd, width, height, format,
                                      handles, strides,
@@ -374,9 +992,6 @@ static uint32_t egl_bo_to_fb(int fd, struct gbm_bo* bo, int format,
 
 static int egl_attach_dmabuf(egl_ctx *ctx, int dma_fd, int width, int height)
 {
-  static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d = NULL;
-  static PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
-  static PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
   EGLImageKHR image;
 
   /* Cursor format should be ARGB8888 */
@@ -395,22 +1010,8 @@ static int egl_attach_dmabuf(egl_ctx *ctx, int dma_fd, int width, int height)
     EGL_NONE,
   };
 
-  if (!create_image)
-    EGL_LOAD_PROC(create_image, PFNEGLCREATEIMAGEKHRPROC,
-                  "eglCreateImageKHR");
-
-  if (!destroy_image)
-    EGL_LOAD_PROC(destroy_image, PFNEGLDESTROYIMAGEKHRPROC,
-                  "eglDestroyImageKHR");
-
-  if (!image_target_texture_2d)
-    EGL_LOAD_PROC(image_target_texture_2d, PFNGLEGLIMAGETARGETTEXTURE2DOESPROC,
-                  "glEGLImageTargetTexture2DOES");
-
-  if (!create_image || !destroy_image || !image_target_texture_2d) {
-    DRM_ERROR("failed to get proc address\n");
+  if (egl_load_procs() < 0)
     return -1;
-  }
 
   image = create_image(ctx->egl_display, ctx->egl_context,
                        EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
@@ -424,16 +1025,66 @@ static int egl_attach_dmabuf(egl_ctx *ctx, int dma_fd, int width, int height)
   return 0;
 }
 
-drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle,
-                                    int w, int h, int scaled_w, int scaled_h,
-                                    int x, int y)
+/* Transform vertices like the plane rotation, reflecting before rotating */
+static void egl_rotate_verts(GLfloat *verts, uint32_t rotation)
+{
+  GLfloat x, y, tmp;
+
+  for (int i = 0; i < 4; i++) {
+    /* To Y-down like the screen coordinates */
+    x = verts[2 * i];
+    y = -verts[2 * i + 1];
+
+    if (rotation & DRM_MODE_REFLECT_X)
+      x = -x;
+
+    if (rotation & DRM_MODE_REFLECT_Y)
+      y = -y;
+
+    /* Counter clockwise */
+    switch (rotation & DRM_MODE_ROTATE_MASK) {
+    case DRM_MODE_ROTATE_90:
+      tmp = x;
+      x = y;
+      y = -tmp;
+      break;
+    case DRM_MODE_ROTATE_180:
+      x = -x;
+      y = -y;
+      break;
+    case DRM_MODE_ROTATE_270:
+      tmp = x;
+      x = -y;
+      y = tmp;
+      break;
+    }
+
+    verts[2 * i] = x;
+    verts[2 * i + 1] = -y;
+  }
+}
+
+/* Swap the size for 90/270 rotations */
+static void egl_rotate_size(int *width, int *height, uint32_t rotation)
+{
+  int tmp;
+
+  if (!(rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270)))
+    return;
+
+  tmp = *width;
+  *width = *height;
+  *height = tmp;
+}
+
+/**
+ * Draw the texture bound to unit 0 into the current target.
+ * The width/height and offsets are in the unrotated coordinates.
+ */
+static void egl_draw_quad(egl_ctx *ctx, int width, int height, int x, int y,
+                          uint32_t rotation)
 {
-  egl_ctx *ctx = data;
   GLint position;
-  GLuint texture;
-  struct gbm_bo* bo;
-  uint32_t fb = 0;
-  int dma_fd;
 
   GLfloat verts[] = {
     -1.0f, -1.0f,
@@ -442,57 +1093,302 @@ drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle,
      1.0f,  1.0f,
   };
 
-  if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &dma_fd) < 0) {
-    DRM_ERROR("failed to get dma fd (-%d)\n", errno);
-    return 0;
-  }
-
-  if (ctx->width != scaled_w || ctx->height != scaled_h) {
-    ctx->width = scaled_w;
-    ctx->height = scaled_h;
-    glViewport(0, 0, ctx->width, ctx->height);
-
-    egl_flush_surfaces(ctx);
-  }
-
-  ctx->current_surface = (ctx->current_surface + 1) % ctx->num_surfaces;
-  eglMakeCurrent(ctx->egl_display, ctx->egl_surfaces[ctx->current_surface],
-                 ctx->egl_surfaces[ctx->current_surface],
-                 ctx->egl_context);
-
   /* Apply offsets */
   for (int i = 0; i < 4; i++) {
-    verts[2 * i] += x * 2.0 / ctx->width;
-    verts[2 * i + 1] -= y * 2.0 / ctx->height;
+    verts[2 * i] += x * 2.0 / width;
+    verts[2 * i + 1] -= y * 2.0 / height;
   }
 
+  egl_rotate_verts(verts, rotation);
+
   position = glGetAttribLocation(ctx->program, "position");
   glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, verts);
   glEnableVertexAttribArray(position);
 
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* Draw the cursor dmabuf into the current target */
+static int egl_draw(egl_ctx *ctx, int dma_fd, int w, int h,
+                    int width, int height, int x, int y, uint32_t rotation)
+{
+  GLuint texture;
+  int ret = 0;
+
   glGenTextures(1, &texture);
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
 
   if (egl_attach_dmabuf(ctx, dma_fd, w, h) < 0) {
     DRM_ERROR("failed to attach dmabuf\n");
-    goto err_del_texture;
+    ret = -1;
+    goto out;
   }
 
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  eglSwapBuffers(ctx->egl_display, ctx->egl_surfaces[ctx->current_surface]);
+  egl_draw_quad(ctx, width, height, x, y, rotation);
+out:
+  glDeleteTextures(1, &texture);
+  return ret;
+}
+
+/* Render the cursor dmabuf into the target, waiting for it */
+static int egl_render(egl_ctx *ctx, egl_target *target, int fd,
+                      uint32_t handle, int w, int h, int scaled_w, int scaled_h,
+                      int x, int y, uint32_t rotation)
+{
+  int dma_fd, ret;
 
-  bo = gbm_surface_lock_front_buffer(ctx->gbm_surfaces[ctx->current_surface]);
-  if (!bo) {
-    DRM_ERROR("failed to get front bo\n");
-    goto err_del_texture;
+  if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &dma_fd) < 0) {
+    DRM_ERROR("failed to get dma fd (-%d)\n", errno);
+    return -1;
   }
 
-  fb = egl_bo_to_fb(fd, bo, ctx->format, ctx->modifier);
-  gbm_surface_release_buffer(ctx->gbm_surfaces[ctx->current_surface], bo);
+  glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+  glViewport(0, 0, gbm_bo_get_width(target->bo),
+             gbm_bo_get_height(target->bo));
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  ret = egl_draw(ctx, dma_fd, w, h, scaled_w, scaled_h, x, y, rotation);
+
+  /* No fence for scanout, wait for it */
+  glFinish();
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-err_del_texture:
-  glDeleteTextures(1, &texture);
   close(dma_fd);
-  return fb;
+  return ret;
+}
+
+drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle,
+                                    int w, int h, int scaled_w, int scaled_h,
+                                    int x, int y, uint32_t rotation)
+{
+  egl_ctx *ctx = data;
+  egl_pooled *pooled;
+  egl_pool *pool;
+  int width = scaled_w, height = scaled_h;
+
+  egl_rotate_size(&width, &height, rotation);
+
+  if (egl_bind_context(ctx) < 0)
+    return 0;
+
+  pool = egl_get_pool(ctx, width, height, ctx->format, ctx->modifier);
+  pooled = egl_get_pooled(ctx, pool);
+  if (!pooled)
+    return 0;
+
+  if (egl_render(ctx, &pooled->target, fd, handle, w, h, scaled_w, scaled_h,
+                 x, y, rotation) < 0)
+    return 0;
+
+  pooled->fb = egl_bo_to_fb(fd, pooled->target.bo, ctx->format,
+                            ctx->modifier);
+  return pooled->fb;
+}
+
+/* Remove the FB from egl_convert_fb(), its buffer goes back to the pool */
+drm_private void egl_release_fb(int fd, void *data, uint32_t fb)
+{
+  egl_ctx *ctx = data;
+  egl_pool *pool;
+  int i, j;
+
+  drmModeRmFB(fd, fb);
+
+  if (!ctx)
+    return;
+
+  for (i = 0; i < MAX_NUM_POOLS; i++) {
+    pool = &ctx->pools[i];
+    for (j = 0; j < pool->num_buffers; j++) {
+      if (pool->buffers[j].fb == fb) {
+        pool->buffers[j].fb = 0;
+        pool->last_released = j;
+        return;
+      }
+    }
+  }
+}
+
+drm_private void egl_free_buffer(int fd, void *buffer, int keep_fb)
+{
+  egl_buffer *buf = buffer;
+
+  if (!buf)
+    return;
+
+  if (buf->fb && !keep_fb)
+    drmModeRmFB(fd, buf->fb);
+
+  if (buf->bo)
+    gbm_bo_destroy(buf->bo);
+
+  free(buf);
+}
+
+/**
+ * Convert into a standalone buffer, which is owned by the caller.
+ * The format could differ from the ctx's, e.g. reduced-depth ones.
+ */
+drm_private void *egl_convert_buffer(int fd, void *data, uint32_t handle,
+                                     int w, int h, int scaled_w, int scaled_h,
+                                     int x, int y, uint32_t rotation,
+                                     uint32_t format, uint64_t modifier,
+                                     uint32_t *fb, uint64_t *size)
+{
+  egl_ctx *ctx = data;
+  egl_target target;
+  egl_buffer *buf;
+  int width = scaled_w, height = scaled_h;
+
+  buf = calloc(1, sizeof(*buf));
+  if (!buf)
+    return NULL;
+
+  egl_rotate_size(&width, &height, rotation);
+
+  if (egl_bind_context(ctx) < 0)
+    goto err;
+
+  if (egl_init_target(ctx, &target, width, height, format, modifier) < 0)
+    goto err;
+
+  buf->bo = target.bo;
+  buf->format = format;
+  buf->modifier = modifier;
+  if (egl_render(ctx, &target, fd, handle, w, h, scaled_w, scaled_h,
+                 x, y, rotation) < 0) {
+    egl_release_target(ctx, &target);
+    goto err;
+  }
+
+  /* Only the bo is needed for scanout */
+  egl_release_target(ctx, &target);
+
+  buf->fb = egl_bo_to_fb(fd, buf->bo, format, modifier);
+  if (!buf->fb)
+    goto err;
+
+  *fb = buf->fb;
+  if (size)
+    *size = (uint64_t)gbm_bo_get_stride(buf->bo) * gbm_bo_get_height(buf->bo);
+  return buf;
+err:
+  egl_free_buffer(fd, buf, 0);
+  return NULL;
+}
+
+/**
+ * Share the buffer with another CRTC of the same device, by a new FB of it.
+ * The FB keeps the memory alive, the source buffer could be freed later.
+ */
+drm_private void *egl_share_buffer(int fd, void *buffer, uint32_t *fb)
+{
+  egl_buffer *src = buffer, *buf;
+
+  if (!src || !src->bo)
+    return NULL;
+
+  buf = calloc(1, sizeof(*buf));
+  if (!buf)
+    return NULL;
+
+  buf->format = src->format;
+  buf->modifier = src->modifier;
+  buf->fb = egl_bo_to_fb(fd, src->bo, src->format, src->modifier);
+  if (!buf->fb) {
+    free(buf);
+    return NULL;
+  }
+
+  *fb = buf->fb;
+  return buf;
+}
+
+/**
+ * Convert the ARGB8888 cursor in memory on a headless ctx, reading the
+ * result back into out, of the rotated scaled size, in GL's row order.
+ */
+drm_private int egl_convert_pixels(void *data, const void *pixels, int w, int h,
+                                   int scaled_w, int scaled_h, int x, int y,
+                                   uint32_t rotation, void *out)
+{
+  egl_ctx *ctx = data;
+  egl_target *target = &ctx->mem_target;
+  GLenum format = ctx->has_bgra ? GL_BGRA_EXT : GL_RGBA;
+  GLuint texture;
+  int width = scaled_w, height = scaled_h, ret = 0;
+
+  if (!ctx->headless)
+    return -1;
+
+  egl_rotate_size(&width, &height, rotation);
+
+  if (ctx->mem_width != width || ctx->mem_height != height) {
+    egl_release_target(ctx, target);
+    ctx->mem_width = ctx->mem_height = 0;
+
+    glGenTextures(1, &target->texture);
+    glBindTexture(GL_TEXTURE_2D, target->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, target->texture, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      DRM_ERROR("incomplete framebuffer\n");
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      egl_release_target(ctx, target);
+      return -1;
+    }
+
+    ctx->mem_width = width;
+    ctx->mem_height = height;
+  }
+
+  /* Like importing the dmabuf, upload for every conversion */
+  glGenTextures(1, &texture);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format,
+               GL_UNSIGNED_BYTE, pixels);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+  glViewport(0, 0, width, height);
+  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  egl_draw_quad(ctx, scaled_w, scaled_h, x, y, rotation);
+
+  /* Waits for the rendering */
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, out);
+  if (glGetError() != GL_NO_ERROR)
+    ret = -1;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteTextures(1, &texture);
+  return ret;
+}
+
+drm_private uint64_t egl_get_mem_usage(void *data)
+{
+  egl_ctx *ctx = data;
+  uint64_t size = 0;
+  int i;
+
+  if (!ctx)
+    return 0;
+
+  for (i = 0; i < MAX_NUM_POOLS; i++)
+    size += egl_pool_size(&ctx->pools[i]);
+
+  return size;
 }
@@ -19,8 +19,15 @@
 
 #include "drm_common.h"
 
-drm_private void *egl_init_ctx(int fd, int num_surfaces, int format, uint64_t modifier);
+drm_private void *egl_init_ctx(int fd, int max_buffers, uint64_t pool_budget, int format, uint64_t modifier, const char *cache_dir);
+drm_private void *egl_init_headless(const char *cache_dir);
 drm_private void egl_free_ctx(void *data);
-drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y);
+drm_private uint64_t egl_get_mem_usage(void *data);
+drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y, uint32_t rotation);
+drm_private void egl_release_fb(int fd, void *data, uint32_t fb);
+drm_private void *egl_convert_buffer(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y, uint32_t rotation, uint32_t format, uint64_t modifier, uint32_t *fb, uint64_t *size);
+drm_private void *egl_share_buffer(int fd, void *buffer, uint32_t *fb);
+drm_private void egl_free_buffer(int fd, void *buffer, int keep_fb);
+drm_private int egl_convert_pixels(void *data, const void *pixels, int w, int h, int scaled_w, int scaled_h, int x, int y, uint32_t rotation, void *out);
 
 #endif
@@ -0,0 +1,302 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+
+#include "drm_common.h"
+#include "drm_input.h"
+
+/**
+ * Reading pointer events straight from evdev nodes, or any fd providing
+ * struct input_event (e.g. a pipe of synthetic events).
+ */
+
+#define MAX_INPUTS 8
+
+/* Absolute range of synthetic events, like virtual tablets */
+#define DEFAULT_ABS_MAX 32767
+
+/* Counts of a report that start accelerating */
+#define ACCEL_THRESHOLD 4.0
+
+typedef struct {
+  int fd;
+  int monotonic; /* Event times are of CLOCK_MONOTONIC */
+
+  /* Partially read event */
+  char buf[sizeof(struct input_event)];
+  size_t len;
+
+  /* Pending motion of the current report */
+  int rel_x, rel_y;
+  int abs_x, abs_y;
+  int has_rel, has_abs;
+
+  struct input_absinfo abs_info[2];
+} drm_input;
+
+static pthread_mutex_t g_input_mutex = PTHREAD_MUTEX_INITIALIZER;
+static drm_input g_inputs[MAX_INPUTS];
+static int g_num_inputs = 0;
+static int g_wake_fd = -1;
+
+static drm_input_ops g_ops;
+static double g_speed, g_accel;
+static int g_idle_ms;
+
+/* Sub-pixel remainders, only touched by the input thread */
+static double g_rem_x, g_rem_y;
+
+static uint64_t drm_input_time(drm_input *input, struct input_event *ev)
+{
+  struct timespec ts;
+
+  if (input->monotonic)
+    return ev->input_event_sec * 1000000ULL + ev->input_event_usec;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void drm_input_report(drm_input *input, uint64_t time)
+{
+  double dx, dy, gain, speed;
+  int i;
+
+  if (input->has_abs) {
+    double f[2];
+
+    for (i = 0; i < 2; i++) {
+      struct input_absinfo *info = &input->abs_info[i];
+      int value = i ? input->abs_y : input->abs_x;
+      int range = info->maximum - info->minimum;
+
+      f[i] = range > 0 ? (double)(value - info->minimum) / range : 0;
+    }
+
+    g_ops.absolute(f[0], f[1], time);
+  }
+
+  if (input->has_rel) {
+    /* Gain grows linearly with the speed beyond the threshold */
+    speed = hypot(input->rel_x, input->rel_y);
+    gain = g_speed;
+    if (speed > ACCEL_THRESHOLD)
+      gain *= 1.0 + g_accel * (speed - ACCEL_THRESHOLD) / ACCEL_THRESHOLD;
+
+    dx = input->rel_x * gain + g_rem_x;
+    dy = input->rel_y * gain + g_rem_y;
+    g_rem_x = dx - (int)dx;
+    g_rem_y = dy - (int)dy;
+
+    if ((int)dx || (int)dy)
+      g_ops.motion((int)dx, (int)dy, time);
+  }
+
+  input->rel_x = input->rel_y = 0;
+  input->has_rel = input->has_abs = 0;
+}
+
+static void drm_input_event(drm_input *input, struct input_event *ev)
+{
+  switch (ev->type) {
+  case EV_REL:
+    if (ev->code == REL_X)
+      input->rel_x += ev->value;
+    else if (ev->code == REL_Y)
+      input->rel_y += ev->value;
+    else
+      break;
+
+    input->has_rel = 1;
+    break;
+  case EV_ABS:
+    if (ev->code == ABS_X)
+      input->abs_x = ev->value;
+    else if (ev->code == ABS_Y)
+      input->abs_y = ev->value;
+    else
+      break;
+
+    input->has_abs = 1;
+    break;
+  case EV_SYN:
+    if (ev->code == SYN_REPORT)
+      drm_input_report(input, drm_input_time(input, ev));
+    else if (ev->code == SYN_DROPPED)
+      input->has_rel = input->has_abs = 0;
+    break;
+  default:
+    break;
+  }
+}
+
+/* Returns -1 when the fd is gone */
+static int drm_input_read(drm_input *input)
+{
+  struct input_event evs[64];
+  char *buf = (char *)evs;
+  ssize_t len;
+  size_t i;
+
+  /* Continue the partially read event */
+  memcpy(buf, input->buf, input->len);
+
+  len = read(input->fd, buf + input->len, sizeof(evs) - input->len);
+  if (len <= 0)
+    return (len < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+
+  len += input->len;
+  for (i = 0; i + sizeof(*evs) <= (size_t)len; i += sizeof(*evs))
+    drm_input_event(input, (struct input_event *)(buf + i));
+
+  input->len = len - i;
+  memcpy(input->buf, buf + i, input->len);
+  return 0;
+}
+
+static void *drm_input_thread_fn(void *data)
+{
+  struct pollfd fds[MAX_INPUTS + 1];
+  int i, num, timeout = -1;
+  uint64_t value;
+
+  pthread_setname_np(pthread_self(), "drm-cursor-input");
+
+  while (1) {
+    pthread_mutex_lock(&g_input_mutex);
+    num = g_num_inputs;
+    for (i = 0; i < num; i++) {
+      fds[i].fd = g_inputs[i].fd;
+      fds[i].events = POLLIN;
+    }
+    pthread_mutex_unlock(&g_input_mutex);
+
+    fds[num].fd = g_wake_fd;
+    fds[num].events = POLLIN;
+
+    i = poll(fds, num + 1, timeout);
+    if (i < 0) {
+      if (errno == EINTR)
+        continue;
+
+      DRM_ERROR("input: failed to poll (%d)\n", errno);
+      break;
+    }
+
+    /* Settled */
+    if (!i) {
+      g_ops.idle();
+      timeout = -1;
+      continue;
+    }
+
+    if (fds[num].revents && read(g_wake_fd, &value, sizeof(value)) < 0)
+      DRM_DEBUG("input: failed to read wake fd (%d)\n", errno);
+
+    for (i = 0; i < num; i++) {
+      if (!fds[i].revents)
+        continue;
+
+      timeout = g_idle_ms;
+      if (!drm_input_read(&g_inputs[i]))
+        continue;
+
+      DRM_INFO("input: fd %d closed\n", g_inputs[i].fd);
+
+      /* Keep the slot, polling fd -1 is a no-op */
+      close(g_inputs[i].fd);
+      pthread_mutex_lock(&g_input_mutex);
+      g_inputs[i].fd = -1;
+      pthread_mutex_unlock(&g_input_mutex);
+    }
+  }
+
+  return NULL;
+}
+
+drm_private int drm_input_init(const drm_input_ops *ops, double speed,
+                               double accel, int idle_ms)
+{
+  pthread_t thread;
+
+  g_ops = *ops;
+  g_speed = speed;
+  g_accel = accel;
+  g_idle_ms = idle_ms;
+
+  g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (g_wake_fd < 0)
+    return -1;
+
+  if (pthread_create(&thread, NULL, drm_input_thread_fn, NULL)) {
+    close(g_wake_fd);
+    g_wake_fd = -1;
+    return -1;
+  }
+
+  pthread_detach(thread);
+
+  DRM_INFO("input: speed: %.2f accel: %.2f\n", speed, accel);
+  return 0;
+}
+
+/* Take the fd, which should be non-blocking */
+drm_private int drm_input_add_fd(int fd)
+{
+  int clock = CLOCK_MONOTONIC;
+  uint64_t value = 1;
+  drm_input *input;
+
+  if (g_wake_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&g_input_mutex);
+  if (g_num_inputs == MAX_INPUTS) {
+    pthread_mutex_unlock(&g_input_mutex);
+    DRM_ERROR("input: too many inputs\n");
+    return -1;
+  }
+
+  input = &g_inputs[g_num_inputs];
+  memset(input, 0, sizeof(*input));
+  input->fd = fd;
+
+  /* Not an evdev node, e.g. synthetic events */
+  input->monotonic = !ioctl(fd, EVIOCSCLOCKID, &clock);
+  if (ioctl(fd, EVIOCGABS(ABS_X), &input->abs_info[0]) < 0 ||
+      ioctl(fd, EVIOCGABS(ABS_Y), &input->abs_info[1]) < 0) {
+    input->abs_info[0].maximum = DEFAULT_ABS_MAX;
+    input->abs_info[1].maximum = DEFAULT_ABS_MAX;
+  }
+
+  g_num_inputs++;
+  pthread_mutex_unlock(&g_input_mutex);
+
+  if (write(g_wake_fd, &value, sizeof(value)) < 0)
+    DRM_DEBUG("input: failed to wake (%d)\n", errno);
+
+  DRM_INFO("input: added fd %d\n", fd);
+  return 0;
+}
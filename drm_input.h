@@ -0,0 +1,36 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_INPUT_H_
+#define __DRM_INPUT_H_
+
+#include <stdint.h>
+
+#include "drm_common.h"
+
+typedef struct {
+  /* Accelerated relative motion, in pixels */
+  void (*motion)(int dx, int dy, uint64_t time);
+
+  /* Absolute position, in fractions of the screen */
+  void (*absolute)(double fx, double fy, uint64_t time);
+
+  /* No input for a while */
+  void (*idle)(void);
+} drm_input_ops;
+
+drm_private int drm_input_init(const drm_input_ops *ops, double speed, double accel, int idle_ms);
+drm_private int drm_input_add_fd(int fd);
+
+#endif
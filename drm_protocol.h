@@ -0,0 +1,100 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_PROTOCOL_H_
+#define __DRM_PROTOCOL_H_
+
+#include <stdint.h>
+
+#include "drm_common.h"
+#include "drm_cursor.h"
+
+/**
+ * Protocol between the hook (client) and the cursor daemon.
+ *
+ * The client connects to the daemon's socket and sends DRM_MSG_HELLO with
+ * its DRM fd (so that the GEM handles are usable by the daemon, and the
+ * commits are made as the master), a memfd of the move ring, and an eventfd.
+ * Moves go through the ring, the eventfd is signaled when it was empty.
+ * Other requests are replied on the socket, after draining the ring.
+ */
+
+#define DRM_DAEMON_SOCKET "/run/drm-cursor-daemon.sock"
+
+#define DRM_RING_SIZE 256 /* Power of 2 */
+#define DRM_RING_MAX_CRTCS 16 /* Coalesced while the ring is full */
+#define DRM_MSG_MAX_FRAMES 64
+
+typedef enum {
+  DRM_MSG_HELLO = 0, /* With fds: DRM, ring memfd, eventfd */
+  DRM_MSG_SET,
+  DRM_MSG_QUERY,
+} drm_msg_type;
+
+typedef struct {
+  uint32_t crtc_id;
+  int32_t x;
+  int32_t y;
+  int32_t count; /* Of the batch, in its first entry */
+  uint64_t timestamp;
+} drm_ring_entry;
+
+/**
+ * The latest position of a CRTC while the ring is full, guarded by seq
+ * (odd while the client is writing it).
+ * Applied once the daemon has consumed the entries before pos.
+ */
+typedef struct {
+  uint32_t seq;
+  uint32_t pos;
+  uint32_t crtc_id;
+  int32_t x;
+  int32_t y;
+  uint64_t timestamp;
+} drm_ring_latest;
+
+/**
+ * Single producer and single consumer.
+ * When full, the client keeps the latest position of each CRTC instead, and
+ * bumps coalesced after updating them.
+ */
+typedef struct {
+  uint32_t head; /* Written by the daemon */
+  uint32_t tail; /* Written by the client */
+  uint32_t coalesced; /* Written by the client */
+  drm_ring_entry entries[DRM_RING_SIZE];
+  drm_ring_latest latest[DRM_RING_MAX_CRTCS];
+} drm_ring;
+
+typedef struct {
+  uint32_t type;
+  uint32_t crtc_id;
+  uint32_t width;
+  uint32_t height;
+  int32_t hot_x;
+  int32_t hot_y;
+  uint32_t interval;
+  int32_t count;
+  uint32_t handles[DRM_MSG_MAX_FRAMES];
+} drm_msg;
+
+typedef struct {
+  int32_t ret;
+  drm_cursor_info info;
+} drm_msg_reply;
+
+/* Stop using the client's file in the daemon, it might be the DRM master */
+drm_private void drm_daemon_detach(int fd);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/**
+ * Test of the direct input, with synthetic events through a pipe, e.g.:
+ * cursor-input-test [crtc_id]
+ * Expects the default evdev-speed= and evdev-accel= in the config.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include <xf86drm.h>
+
+#include "drm_cursor.h"
+
+#define CURSOR_WIDTH 64
+#define CURSOR_HEIGHT 64
+
+#define START_X 100
+#define START_Y 100
+
+/* Below the acceleration threshold */
+#define STEP_X 2
+#define STEP_Y 1
+#define STEPS 5
+
+/* Sooner than the input settles, and later than that */
+#define INPUT_TIMEOUT_MS 50
+#define SETTLE_TIMEOUT_MS 1000
+
+static int write_event(int fd, int type, int code, int value)
+{
+  struct input_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+
+  return write(fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+/* Wait for the position to get presented */
+static int wait_position(int fd, uint32_t crtc_id, int x, int y,
+                         int timeout_ms)
+{
+  drm_cursor_info info = { 0 };
+
+  for (; timeout_ms > 0; timeout_ms--) {
+    if (!drm_cursor_query(fd, crtc_id, &info) && info.visible &&
+        info.x == x && info.y == y)
+      return 0;
+
+    usleep(1000);
+  }
+
+  fprintf(stderr, "expected (%d,%d), got (%d,%d)\n", x, y, info.x, info.y);
+  return -1;
+}
+
+int main(int argc, const char **argv)
+{
+  struct drm_mode_create_dumb create_arg = {
+    .width = CURSOR_WIDTH,
+    .height = CURSOR_HEIGHT,
+    .bpp = 32,
+  };
+  uint32_t crtc_id = argc > 1 ? atoi(argv[1]) : 0;
+  int fd, fds[2], i;
+
+  fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+  if (fd < 0 || drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg) < 0) {
+    fprintf(stderr, "failed to create cursor\n");
+    return -1;
+  }
+
+  if (pipe(fds) < 0 || drm_cursor_add_input(fds[0]) < 0) {
+    fprintf(stderr, "failed to add input\n");
+    return -1;
+  }
+
+  if (drm_cursor_set(fd, crtc_id, create_arg.handle,
+                     CURSOR_WIDTH, CURSOR_HEIGHT, 0, 0) < 0 ||
+      drm_cursor_move(fd, crtc_id, START_X, START_Y, 0) < 0 ||
+      wait_position(fd, crtc_id, START_X, START_Y, SETTLE_TIMEOUT_MS) < 0) {
+    fprintf(stderr, "failed to set cursor\n");
+    return -1;
+  }
+
+  for (i = 0; i < STEPS; i++) {
+    if (write_event(fds[1], EV_REL, REL_X, STEP_X) < 0 ||
+        write_event(fds[1], EV_REL, REL_Y, STEP_Y) < 0 ||
+        write_event(fds[1], EV_SYN, SYN_REPORT, 0) < 0) {
+      fprintf(stderr, "failed to write events\n");
+      return -1;
+    }
+  }
+
+  /* Moved by the input, without the server */
+  if (wait_position(fd, crtc_id, START_X + STEP_X * STEPS,
+                    START_Y + STEP_Y * STEPS, INPUT_TIMEOUT_MS) < 0) {
+    fprintf(stderr, "FAIL: input not applied\n");
+    return -1;
+  }
+
+  /* The server never followed, so back to its position once settled */
+  if (wait_position(fd, crtc_id, START_X, START_Y, SETTLE_TIMEOUT_MS) < 0) {
+    fprintf(stderr, "FAIL: not reconciled with the server\n");
+    return -1;
+  }
+
+  printf("PASS\n");
+  return 0;
+}